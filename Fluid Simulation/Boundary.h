@@ -0,0 +1,100 @@
+#pragma once
+#ifndef BOUNDARY_H
+#define BOUNDARY_H
+
+// Compile-time boundary policies for StaticFluid, chosen per side through Boundary::Sides. A policy fills a ghost
+// cell from the interior cell beside it, the interior cell that wraps onto it, and the side's inflow value.
+namespace Boundary {
+	// What a field is to the side being filled: velocity components split into the one crossing the side and the one along it
+	enum class Field { SCALAR, PRESSURE, NORMAL, TANGENTIAL };
+
+	// Reflective wall: nothing crosses it, flow slides along it (Stam's SetBnd)
+	struct FreeSlip {
+		static constexpr bool periodic = false;
+		static constexpr bool open = false;
+
+		template <Field F, typename Real>
+		static Real Ghost(Real inside, Real, Real) {
+			return F == Field::NORMAL ? -inside : inside;
+		}
+	};
+
+	// Wall that also holds the tangential velocity at zero
+	struct NoSlip {
+		static constexpr bool periodic = false;
+		static constexpr bool open = false;
+
+		template <Field F, typename Real>
+		static Real Ghost(Real inside, Real, Real) {
+			return (F == Field::NORMAL || F == Field::TANGENTIAL) ? -inside : inside;
+		}
+	};
+
+	// Wraps onto the opposite side; both sides of an axis must use it
+	struct Periodic {
+		static constexpr bool periodic = true;
+		static constexpr bool open = false;
+
+		template <Field F, typename Real>
+		static Real Ghost(Real, Real opposite, Real) {
+			return opposite;
+		}
+	};
+
+	// Open side that lets everything leave: zero gradient for the fields, zero pressure at the face
+	struct Outflow {
+		static constexpr bool periodic = false;
+		static constexpr bool open = true;
+
+		template <Field F, typename Real>
+		static Real Ghost(Real inside, Real, Real) {
+			return F == Field::PRESSURE ? -inside : inside;
+		}
+	};
+
+	// Open side with the normal velocity and the scalar held at the inflow value on the face
+	struct Inflow {
+		static constexpr bool periodic = false;
+		static constexpr bool open = true;
+
+		template <Field F, typename Real>
+		static Real Ghost(Real inside, Real, Real value) {
+			if (F == Field::NORMAL || F == Field::SCALAR)
+				return 2 * value - inside;
+			return F == Field::TANGENTIAL ? -inside : inside;
+		}
+	};
+
+	// Velocity components follow one policy, the scalar and pressure another
+	template <typename Velocity, typename Scalar>
+	struct PerField {
+		static_assert(Velocity::periodic == Scalar::periodic, "a side cannot wrap for some fields only");
+
+		static constexpr bool periodic = Velocity::periodic;
+		static constexpr bool open = Velocity::open;
+
+		template <Field F, typename Real>
+		static Real Ghost(Real inside, Real opposite, Real value) {
+			return (F == Field::NORMAL || F == Field::TANGENTIAL)
+				? Velocity::template Ghost<F>(inside, opposite, value)
+				: Scalar::template Ghost<F>(inside, opposite, value);
+		}
+	};
+
+	template <typename LeftSide, typename RightSide = LeftSide, typename BottomSide = LeftSide, typename TopSide = BottomSide>
+	struct Sides {
+		static_assert(LeftSide::periodic == RightSide::periodic, "left and right must both be periodic or neither");
+		static_assert(BottomSide::periodic == TopSide::periodic, "bottom and top must both be periodic or neither");
+
+		using Left = LeftSide;
+		using Right = RightSide;
+		using Bottom = BottomSide;
+		using Top = TopSide;
+	};
+
+	using Box = Sides<FreeSlip>;
+	using WindTunnel = Sides<Inflow, Outflow, FreeSlip, FreeSlip>;
+	using Torus = Sides<Periodic>;
+}
+
+#endif
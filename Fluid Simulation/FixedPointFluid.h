@@ -0,0 +1,394 @@
+#pragma once
+#ifndef FIXED_POINT_FLUID_H
+#define FIXED_POINT_FLUID_H
+
+#include "Simulation.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FIXED_POINT_SSE2
+#include <emmintrin.h>
+#endif
+
+// Stable fluids in 16.16 fixed point for lockstep replays. Every step after the inputs are quantized is integer
+// arithmetic, and every pass is order-independent (Jacobi relaxation, row kernels reading only the previous
+// field), so the result is bit-identical across compilers, CPUs, SIMD widths and thread counts.
+class FixedPointFluid : public Simulation {
+private:
+	static constexpr int fractionBits = 16;
+	static constexpr int32_t one = 1 << fractionBits;
+
+	// Every field, pressure included, saturates at +-4096 on store, so four-neighbour sums and the divergence
+	// stay inside 32 bits
+	static constexpr int32_t limit = 4096 << fractionBits;
+
+	int diffusionIterations = 16;
+	int pressureIterations = 32;
+
+	// diffusion * (size - 2)^2 and viscocity * (size - 2)^2, the rates Fluid::Diffuse scales by dt
+	int64_t diffusionRate;
+	int64_t viscosityRate;
+
+	std::vector<int32_t> pVx;
+	std::vector<int32_t> pVy;
+	std::vector<int32_t> Vx;
+	std::vector<int32_t> Vy;
+	std::vector<int32_t> s;
+	std::vector<int32_t> dye;
+	std::vector<int32_t> scratch;
+
+	ThreadPool pool;
+
+private:
+	static int32_t MulFixed(int32_t x, uint32_t w);
+	static int32_t Saturate(int64_t x);
+	static int32_t ToFixed(float x);
+
+	void SetBnd(int b, std::vector<int32_t>& x);
+
+	void Diffuse(int b, std::vector<int32_t>& x, std::vector<int32_t>& x0, int64_t rate, int32_t dt);
+	void DiffuseRow(std::vector<int32_t>& x, std::vector<int32_t>& from, std::vector<int32_t>& x0, uint32_t w0, uint32_t w1, int j);
+	void Project(std::vector<int32_t>& vx, std::vector<int32_t>& vy, std::vector<int32_t>& p, std::vector<int32_t>& div);
+	void PressureRow(std::vector<int32_t>& p, std::vector<int32_t>& from, std::vector<int32_t>& div, int j);
+	void Advect(int b, std::vector<int32_t>& d, std::vector<int32_t>& d0, std::vector<int32_t>& vx, std::vector<int32_t>& vy, int32_t dt);
+	void AdvectRow(std::vector<int32_t>& d, std::vector<int32_t>& d0, std::vector<int32_t>& vx, std::vector<int32_t>& vy, uint32_t dt0, int32_t reach, int j);
+
+public:
+	FixedPointFluid(const int& grid_size, const float& diffusion, const float& viscocity);
+
+	void AddDensity(int x, int y, float amount) override;
+	void AddVelocity(int x, int y, glm::vec2 amount) override;
+
+	void Update(const float& dt) override;
+
+	void Clean() override;
+};
+
+#ifdef FIXED_POINT_SSE2
+namespace FixedPoint {
+	// (x * w + 2^15) >> 16 per lane for signed x and unsigned w, identical to MulFixed. _mm_mul_epu32 is
+	// unsigned, so x is biased by 2^31 and the bias comes back out after the shift as exactly 2^15 * w.
+	inline __m128i Mul4(__m128i x, __m128i w) {
+		const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+		const __m128i half = _mm_set_epi32(0, 0x8000, 0, 0x8000);
+		const __m128i low = _mm_set_epi32(0, -1, 0, -1);
+
+		__m128i u = _mm_xor_si128(x, sign);
+		__m128i even = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(u, w), half), 16);
+		__m128i odd = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(u, 32), _mm_srli_epi64(w, 32)), half), 16);
+		__m128i product = _mm_or_si128(_mm_and_si128(even, low), _mm_slli_epi64(odd, 32));
+		return _mm_sub_epi32(product, _mm_slli_epi32(w, 15));
+	}
+
+	// SSE2 has no 32-bit min/max, so clamp through compare masks
+	inline __m128i Clamp4(__m128i x, __m128i lo, __m128i hi) {
+		__m128i below = _mm_cmpgt_epi32(lo, x);
+		x = _mm_or_si128(_mm_and_si128(below, lo), _mm_andnot_si128(below, x));
+		__m128i above = _mm_cmpgt_epi32(x, hi);
+		return _mm_or_si128(_mm_and_si128(above, hi), _mm_andnot_si128(above, x));
+	}
+}
+#endif
+
+FixedPointFluid::FixedPointFluid(const int& grid_size, const float& diffusion, const float& viscocity)
+	: Simulation(grid_size) {
+
+	// The only floating-point step: parameters are quantized once, in double, which every IEEE target rounds alike
+	double scale = static_cast<double>(size - 2) * (size - 2) * one;
+	diffusionRate = std::llround(static_cast<double>(diffusion) * scale);
+	viscosityRate = std::llround(static_cast<double>(viscocity) * scale);
+
+	pVx = std::vector<int32_t>(size * size);
+	pVy = std::vector<int32_t>(size * size);
+	Vx = std::vector<int32_t>(size * size);
+	Vy = std::vector<int32_t>(size * size);
+	s = std::vector<int32_t>(size * size);
+	dye = std::vector<int32_t>(size * size);
+	scratch = std::vector<int32_t>(size * size);
+}
+
+int32_t FixedPointFluid::MulFixed(int32_t x, uint32_t w) {
+	return static_cast<int32_t>((static_cast<int64_t>(x) * w + 0x8000) >> fractionBits);
+}
+
+int32_t FixedPointFluid::Saturate(int64_t x) {
+	return static_cast<int32_t>(x < -limit ? -limit : (x > limit ? limit : x));
+}
+
+int32_t FixedPointFluid::ToFixed(float x) {
+	// Clamped before rounding so out-of-range inputs cannot overflow the conversion
+	double scaled = static_cast<double>(x) * one;
+	if (scaled < -static_cast<double>(limit)) { scaled = -static_cast<double>(limit); }
+	if (scaled > static_cast<double>(limit)) { scaled = static_cast<double>(limit); }
+	return static_cast<int32_t>(std::llround(scaled));
+}
+
+void FixedPointFluid::AddDensity(int x, int y, float amount) {
+	if (x < 0 || x > size - 1 || y < 0 || y > size - 1)
+		return;
+	int index = (y * size) + x;
+	dye[index] = Saturate(static_cast<int64_t>(dye[index]) + ToFixed(amount));
+}
+
+void FixedPointFluid::AddVelocity(int x, int y, glm::vec2 amount) {
+	if (x < 0 || x > size - 1 || y < 0 || y > size - 1)
+		return;
+	int index = (y * size) + x;
+	Vx[index] = Saturate(static_cast<int64_t>(Vx[index]) + ToFixed(amount.x));
+	Vy[index] = Saturate(static_cast<int64_t>(Vy[index]) + ToFixed(amount.y));
+}
+
+void FixedPointFluid::Update(const float& dt) {
+	// Frame times differ between peers, so a replay must feed the same dt; it is quantized like any other input.
+	// Steps past 1/32 s are cut there, which keeps step * (size - 2) inside 32 bits.
+	int32_t step = ToFixed(dt);
+	if (step > one / 32) { step = one / 32; }
+	if (step < 0) { step = 0; }
+
+	Diffuse(1, pVx, Vx, viscosityRate, step);
+	Diffuse(2, pVy, Vy, viscosityRate, step);
+
+	Project(pVx, pVy, Vx, Vy);
+
+	Advect(1, Vx, pVx, pVx, pVy, step);
+	Advect(2, Vy, pVy, pVx, pVy, step);
+
+	Project(Vx, Vy, pVx, pVy);
+
+	Diffuse(0, s, dye, diffusionRate, step);
+	Advect(0, dye, s, Vx, Vy, step);
+
+	for (int index = 0; index < size * size; index++)
+		density[index] = static_cast<float>(dye[index]) / static_cast<float>(one);
+}
+
+void FixedPointFluid::SetBnd(int b, std::vector<int32_t>& x) {
+	// Fluid::SetBnd with the corner weight 0.33 as 21627 / 2^16
+	const int n = size;
+	for (int i = 1; i < n - 1; i++) {
+		x[i] = (b == 2) ? -x[n + i] : x[n + i];
+		x[(n - 1) * n + i] = (b == 2) ? -x[(n - 2) * n + i] : x[(n - 2) * n + i];
+	}
+	for (int j = 1; j < n - 1; j++) {
+		x[j * n] = (b == 1) ? -x[j * n + 1] : x[j * n + 1];
+		x[j * n + n - 1] = (b == 1) ? -x[j * n + n - 2] : x[j * n + n - 2];
+	}
+
+	x[0] = MulFixed(x[1] + x[n] + x[0], 21627);
+	x[n - 1] = MulFixed(x[n - 2] + x[n + n - 1] + x[n - 1], 21627);
+	x[(n - 1) * n] = MulFixed(x[(n - 1) * n + 1] + x[(n - 2) * n] + x[(n - 1) * n], 21627);
+	x[(n - 1) * n + n - 1] = MulFixed(x[(n - 1) * n + n - 2] + x[(n - 2) * n + n - 1] + x[(n - 1) * n + n - 1], 21627);
+}
+
+void FixedPointFluid::Diffuse(int b, std::vector<int32_t>& x, std::vector<int32_t>& x0, int64_t rate, int32_t dt) {
+	// Jacobi on (1 + 4a) x - a * neighbours = x0: x = w0 * x0 + w1 * neighbours with w0 + 4 * w1 = 1
+	int64_t a = (static_cast<int64_t>(dt) * rate) >> fractionBits;
+	int64_t denominator = static_cast<int64_t>(one) + 4 * a;
+	uint32_t w0 = static_cast<uint32_t>((static_cast<int64_t>(one) << fractionBits) / denominator);
+	uint32_t w1 = static_cast<uint32_t>((a << fractionBits) / denominator);
+
+	x = x0;
+	for (int k = 0; k < diffusionIterations; k++) {
+		std::vector<int32_t>& from = (k % 2 == 0) ? x : scratch;
+		std::vector<int32_t>& to = (k % 2 == 0) ? scratch : x;
+		pool.ParallelFor(1, size - 1, 16, [this, &to, &from, &x0, w0, w1](int begin, int end) {
+			for (int j = begin; j < end; j++)
+				DiffuseRow(to, from, x0, w0, w1, j);
+		});
+		SetBnd(b, to);
+	}
+	if (diffusionIterations % 2 == 1)
+		x = scratch;
+}
+
+void FixedPointFluid::DiffuseRow(std::vector<int32_t>& x, std::vector<int32_t>& from, std::vector<int32_t>& x0, uint32_t w0, uint32_t w1, int j) {
+	const int32_t* row = &from[j * size];
+	const int32_t* below = row - size;
+	const int32_t* above = row + size;
+	const int32_t* src = &x0[j * size];
+	int32_t* dst = &x[j * size];
+	int i = 1;
+
+#ifdef FIXED_POINT_SSE2
+	const __m128i weight0 = _mm_set1_epi32(static_cast<int>(w0));
+	const __m128i weight1 = _mm_set1_epi32(static_cast<int>(w1));
+	for (; i + 4 <= size - 1; i += 4) {
+		__m128i sum = _mm_add_epi32(
+			_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 1)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - 1))),
+			_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(above + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + i))));
+		__m128i value = _mm_add_epi32(FixedPoint::Mul4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), weight0), FixedPoint::Mul4(sum, weight1));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), value);
+	}
+#endif
+
+	for (; i < size - 1; i++)
+		dst[i] = MulFixed(src[i], w0) + MulFixed(row[i + 1] + row[i - 1] + above[i] + below[i], w1);
+}
+
+void FixedPointFluid::Project(std::vector<int32_t>& vx, std::vector<int32_t>& vy, std::vector<int32_t>& p, std::vector<int32_t>& div) {
+	// Fluid::ClearDivergence with the pressure carried pre-multiplied by size, which takes every 1 / size out:
+	// 4p - neighbours = -(du + dv) / 2 and v -= dp / 2, all adds and arithmetic shifts
+	pool.ParallelFor(1, size - 1, 16, [this, &vx, &vy, &p, &div](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			for (int i = 1; i < size - 1; i++) {
+				int index = (j * size) + i;
+				div[index] = -(vx[index + 1] - vx[index - 1] + vy[index + size] - vy[index - size]) >> 1;
+				p[index] = 0;
+			}
+		}
+	});
+	SetBnd(0, div);
+	SetBnd(0, p);
+
+	for (int k = 0; k < pressureIterations; k++) {
+		std::vector<int32_t>& from = (k % 2 == 0) ? p : scratch;
+		std::vector<int32_t>& to = (k % 2 == 0) ? scratch : p;
+		pool.ParallelFor(1, size - 1, 16, [this, &to, &from, &div](int begin, int end) {
+			for (int j = begin; j < end; j++)
+				PressureRow(to, from, div, j);
+		});
+		SetBnd(0, to);
+	}
+	if (pressureIterations % 2 == 1)
+		p = scratch;
+
+	pool.ParallelFor(1, size - 1, 16, [this, &vx, &vy, &p](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			for (int i = 1; i < size - 1; i++) {
+				int index = (j * size) + i;
+				vx[index] = Saturate(static_cast<int64_t>(vx[index]) - ((p[index + 1] - p[index - 1]) >> 1));
+				vy[index] = Saturate(static_cast<int64_t>(vy[index]) - ((p[index + size] - p[index - size]) >> 1));
+			}
+		}
+	});
+	SetBnd(1, vx);
+	SetBnd(2, vy);
+}
+
+void FixedPointFluid::PressureRow(std::vector<int32_t>& p, std::vector<int32_t>& from, std::vector<int32_t>& div, int j) {
+	const int32_t* row = &from[j * size];
+	const int32_t* below = row - size;
+	const int32_t* above = row + size;
+	const int32_t* src = &div[j * size];
+	int32_t* dst = &p[j * size];
+	int i = 1;
+
+#ifdef FIXED_POINT_SSE2
+	const __m128i low = _mm_set1_epi32(-limit);
+	const __m128i high = _mm_set1_epi32(limit);
+	for (; i + 4 <= size - 1; i += 4) {
+		__m128i sum = _mm_add_epi32(
+			_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 1)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - 1))),
+			_mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(above + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(below + i))));
+		sum = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), FixedPoint::Clamp4(_mm_srai_epi32(sum, 2), low, high));
+	}
+#endif
+
+	// Four saturated neighbours and a divergence of at most 2^29 sum below 2^31, and the result saturates like any field
+	for (; i < size - 1; i++)
+		dst[i] = Saturate((src[i] + row[i + 1] + row[i - 1] + above[i] + below[i]) >> 2);
+}
+
+void FixedPointFluid::Advect(int b, std::vector<int32_t>& d, std::vector<int32_t>& d0, std::vector<int32_t>& vx, std::vector<int32_t>& vy, int32_t dt) {
+	uint32_t dt0 = static_cast<uint32_t>(dt) * static_cast<uint32_t>(size - 2);
+
+	// Any velocity that carries the backtrace a full grid width lands on the clamp, so velocities are capped there
+	// first. That keeps velocity * dt0 inside 32 bits on every grid size without changing a result.
+	int32_t reach = limit;
+	if (dt0 > 0) {
+		int64_t across = ((static_cast<int64_t>(size) << (2 * fractionBits)) + dt0 - 1) / dt0;
+		if (across < reach) { reach = static_cast<int32_t>(across); }
+	}
+
+	pool.ParallelFor(1, size - 1, 16, [this, &d, &d0, &vx, &vy, dt0, reach](int begin, int end) {
+		for (int j = begin; j < end; j++)
+			AdvectRow(d, d0, vx, vy, dt0, reach, j);
+	});
+	SetBnd(b, d);
+}
+
+void FixedPointFluid::AdvectRow(std::vector<int32_t>& d, std::vector<int32_t>& d0, std::vector<int32_t>& vx, std::vector<int32_t>& vy, uint32_t dt0, int32_t reach, int j) {
+	// Backtraces clamp to [0.5, size - 1.5] so both bilinear corners are in range without per-index clamps
+	const int32_t lo = one / 2;
+	const int32_t hi = (size - 1) * one - one / 2 - 1;
+	const int row = j * size;
+	int i = 1;
+
+#ifdef FIXED_POINT_SSE2
+	const __m128i lo4 = _mm_set1_epi32(lo);
+	const __m128i hi4 = _mm_set1_epi32(hi);
+	const __m128i dt4 = _mm_set1_epi32(static_cast<int>(dt0));
+	const __m128i fraction = _mm_set1_epi32(one - 1);
+	const __m128i one4 = _mm_set1_epi32(one);
+	const __m128i lane = _mm_setr_epi32(0, one, 2 * one, 3 * one);
+	const __m128i y4 = _mm_set1_epi32(j * one);
+	const __m128i reachLow = _mm_set1_epi32(-reach);
+	const __m128i reachHigh = _mm_set1_epi32(reach);
+
+	for (; i + 4 <= size - 1; i += 4) {
+		__m128i x = _mm_add_epi32(_mm_set1_epi32(i * one), lane);
+		__m128i u = FixedPoint::Clamp4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&vx[row + i])), reachLow, reachHigh);
+		__m128i v = FixedPoint::Clamp4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&vy[row + i])), reachLow, reachHigh);
+		x = _mm_sub_epi32(x, FixedPoint::Mul4(u, dt4));
+		__m128i y = _mm_sub_epi32(y4, FixedPoint::Mul4(v, dt4));
+		x = FixedPoint::Clamp4(x, lo4, hi4);
+		y = FixedPoint::Clamp4(y, lo4, hi4);
+
+		// No gather before AVX2: spill the cell coordinates and load the corners one by one
+		alignas(16) int32_t cx[4], cy[4];
+		alignas(16) int32_t c00[4], c01[4], c10[4], c11[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(cx), _mm_srai_epi32(x, fractionBits));
+		_mm_store_si128(reinterpret_cast<__m128i*>(cy), _mm_srai_epi32(y, fractionBits));
+		for (int k = 0; k < 4; k++) {
+			int base = (cy[k] * size) + cx[k];
+			c00[k] = d0[base];
+			c01[k] = d0[base + size];
+			c10[k] = d0[base + 1];
+			c11[k] = d0[base + size + 1];
+		}
+
+		__m128i s1 = _mm_and_si128(x, fraction), s0 = _mm_sub_epi32(one4, s1);
+		__m128i t1 = _mm_and_si128(y, fraction), t0 = _mm_sub_epi32(one4, t1);
+		__m128i left = _mm_add_epi32(
+			FixedPoint::Mul4(_mm_load_si128(reinterpret_cast<const __m128i*>(c00)), t0),
+			FixedPoint::Mul4(_mm_load_si128(reinterpret_cast<const __m128i*>(c01)), t1));
+		__m128i right = _mm_add_epi32(
+			FixedPoint::Mul4(_mm_load_si128(reinterpret_cast<const __m128i*>(c10)), t0),
+			FixedPoint::Mul4(_mm_load_si128(reinterpret_cast<const __m128i*>(c11)), t1));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&d[row + i]), _mm_add_epi32(FixedPoint::Mul4(left, s0), FixedPoint::Mul4(right, s1)));
+	}
+#endif
+
+	for (; i < size - 1; i++) {
+		int32_t u = vx[row + i] < -reach ? -reach : (vx[row + i] > reach ? reach : vx[row + i]);
+		int32_t v = vy[row + i] < -reach ? -reach : (vy[row + i] > reach ? reach : vy[row + i]);
+		int32_t x = i * one - MulFixed(u, dt0);
+		int32_t y = j * one - MulFixed(v, dt0);
+		x = x < lo ? lo : (x > hi ? hi : x);
+		y = y < lo ? lo : (y > hi ? hi : y);
+
+		int base = ((y >> fractionBits) * size) + (x >> fractionBits);
+		uint32_t s1 = static_cast<uint32_t>(x & (one - 1)), s0 = one - s1;
+		uint32_t t1 = static_cast<uint32_t>(y & (one - 1)), t0 = one - t1;
+		int32_t left = MulFixed(d0[base], t0) + MulFixed(d0[base + size], t1);
+		int32_t right = MulFixed(d0[base + 1], t0) + MulFixed(d0[base + size + 1], t1);
+		d[row + i] = MulFixed(left, s0) + MulFixed(right, s1);
+	}
+}
+
+void FixedPointFluid::Clean() {
+	Simulation::Clean();
+	std::fill(pVx.begin(), pVx.end(), 0);
+	std::fill(pVy.begin(), pVy.end(), 0);
+	std::fill(Vx.begin(), Vx.end(), 0);
+	std::fill(Vy.begin(), Vy.end(), 0);
+	std::fill(s.begin(), s.end(), 0);
+	std::fill(dye.begin(), dye.end(), 0);
+}
+
+#endif
@@ -2,22 +2,68 @@
 #ifndef FLUID_H
 #define FLUID_H
 
-#include <glm/glm.hpp>
-#include <glm/gtc/type_ptr.hpp>
-#include <glm/gtx/color_space.hpp>
+#include "Boundary.h"
+#include "Simulation.h"
+#include "Stencil.h"
+#include "TaskGraph.h"
+#include "ThreadPool.h"
+#include "TileScheduler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
 #include <vector>
 
-class Fluid {
-private:
-	enum class ColorSpace { GRAYSCALE, HSV };
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLUID_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+class Fluid : public Simulation {
+public:
+	enum class DiffusionPath { COPY, EXPLICIT, IMPLICIT };
+	enum class Formulation { VELOCITY_PRESSURE, VORTICITY_STREAMFUNCTION };
+	enum class AdvectionScheme { SEMI_LAGRANGIAN, MACCORMACK, BFECC };
+	enum class Interpolation { LINEAR, CUBIC };
+	enum class Solver { GAUSS_SEIDEL, RED_BLACK, JACOBI, MULTIGRID, CONJUGATE_GRADIENT };
 
-	const int size;
+private:
+	// Ghost-cell rules of the four sides. b = 0 covers both the dye and the pressure, and the corners and the
+	// row-by-row passes average or copy from one row only, so any non-periodic policy that treats those alike fits.
+	using Walls = Boundary::Box;
+	static_assert(!Walls::Left::periodic && !Walls::Bottom::periodic, "Fluid's boundary passes cannot wrap");
 
 	float dt = 0;
 	float diff;
 	float visc;
 
+	// Largest relative error tolerated on any Laplacian mode before falling back to the implicit solve
+	float diffusionTolerance = 0.01f;
+	DiffusionPath diffusionPath[3] = { DiffusionPath::IMPLICIT, DiffusionPath::IMPLICIT, DiffusionPath::IMPLICIT };
+
+	// Update splits a frame into substeps that carry nothing more than cflLimit cells, going by peakSpeed: the
+	// largest velocity component the last projection left plus later injections, or -1 when it has to be measured.
+	// Semi-Lagrangian advection is stable at any CFL number; the limit bounds how far a straight backtrace cuts
+	// through curved flow. Frames longer than maxFrameTime are hitches and only that much time is simulated.
+	float cflLimit = 32.0f;
+	int maxSubsteps = 8;
+	float maxFrameTime = 0.1f;
+	float peakSpeed = 0.0f;
+
 	std::vector<float> pVx;
 	std::vector<float> pVy;
 
@@ -25,246 +71,2188 @@ private:
 	std::vector<float> Vy;
 
 	std::vector<float> s;
-	std::vector<float> density;
 
-	ColorSpace renderColorSpace;
+	// Vorticity-streamfunction state, kept between steps to warm-start the Poisson solve
+	Formulation formulation = Formulation::VELOCITY_PRESSURE;
+	std::vector<float> psi;
+
+	// Pressure grid for coarse projection, each cell covering projectionFactor^2 simulation cells
+	int projectionFactor = 1;
+	int coarseSize = 0;
+	std::vector<float> coarseP;
+	std::vector<float> coarseDiv;
+
+	// Iterative refinement: float sweeps on the correction, double residual and accumulated pressure
+	bool mixedPrecisionPressure = false;
+	int refinementCycles = 4;
+	std::vector<double> pressureHi;
+	std::vector<float> pressureResidual;
+	std::vector<float> pressureCorrection;
+
+	// Cache budget for the band of rows LinSolve keeps resident while several sweeps pass over it
+	int wavefrontCacheBytes = 512 * 1024;
+
+	// Backends for the c * x - a * (neighbours + 2x) = x0 systems, bound separately for diffusion and pressure.
+	// Scratch is shared since the two never solve at the same time.
+	Solver diffusionSolver = Solver::GAUSS_SEIDEL;
+	Solver pressureSolver = Solver::GAUSS_SEIDEL;
+	std::vector<float> solverScratch;
+	std::vector<float> solverDirection;
+	std::vector<float> solverProduct;
+
+	// Multigrid hierarchy, one entry per grid that gets coarsened; residual is sized for the finer grid
+	struct GridLevel {
+		int fineN;
+		int n;
+		std::vector<float> x;
+		std::vector<float> rhs;
+		std::vector<float> residual;
+	};
+	std::vector<GridLevel> gridLevels;
+
+	// Iterations per pressure (and streamfunction) solve; AutoTune trades them against the backend
+	int pressureIterations = 16;
+
+	struct TuningConfig {
+		Solver solver;
+		int cacheBytes;
+		int threads;
+		int iterations;
+	};
+
+	// FLIP/PIC velocity particles, bucketed by cell for the particle-to-grid gather.
+	// flipRatio 1 is pure FLIP, 0 pure PIC; flipU/flipV hold the grid velocity the particles last saw.
+	bool flip = false;
+	float flipRatio = 0.95f;
+	int particlesPerCell = 4;
+	std::vector<glm::vec2> particlePos;
+	std::vector<glm::vec2> particleVel;
+	std::vector<glm::vec2> sortedPos;
+	std::vector<glm::vec2> sortedVel;
+	std::vector<int> particleCell;
+	std::vector<int> cellStart;
+	std::vector<int> cellCursor;
+	std::vector<float> flipU;
+	std::vector<float> flipV;
+
+	// Error-corrected advection built from forward and backward Advect passes
+	AdvectionScheme advectionScheme = AdvectionScheme::SEMI_LAGRANGIAN;
+	std::vector<float> advectForward;
+	std::vector<float> advectBackward;
+
+	// Cubic sampling reads a copy of the source with two replicated cells around it, so the 4x4 gather never clamps
+	Interpolation interpolation = Interpolation::LINEAR;
+	std::vector<float> advectPadded;
+
+	// MAC layout: Vx[i, j] lives on the left face of cell (i, j) and Vy[i, j] on its bottom face
+	bool staggered = false;
+
+	ThreadPool pool;
+
+	// Tile stages of the projection and the fused density step; each thread gets a scratch slot that holds one tile
+	// window, and records the largest speed its gradient tiles left behind
+	TileScheduler scheduler;
+	std::vector<std::vector<float>> tileScratch;
+	std::vector<float> tileSpeed;
+
+	// Sparse stepping: a tile whose dye and velocity all stay within sparseEpsilon of zero sleeps at exactly zero in
+	// every field, and a step only visits the awake tiles grown by how far anything can travel during it.
+	// sparseRects holds the visited tiles of the last step as runs along each tile row, sparseBands where each row starts.
+	bool sparse = false;
+	bool sparseSettled = false;
+	float sparseEpsilon = 1e-4f;
+	int sparseMargin = 8;
+	int sparseTileCells = 16;
+	int sparseTiles = 0;
+	std::vector<unsigned char> tileAwake;
+	std::vector<unsigned char> tileVisited;
+	std::vector<TileScheduler::Rect> sparseRects;
+	std::vector<int> sparseBands;
+
+	// A field carried by AdvectShared: boundary type, destination and source
+	struct AdvectTarget {
+		int b;
+		std::vector<float>* d;
+		std::vector<float>* d0;
+	};
 
 private:
 	int IndexAt(int x, int y);
+	int IndexAt(int x, int y, int n);
 
 	void LinSolve(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter);
+	void LinSolve(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n);
+	void LinSolveRow(int b, std::vector<float>& x, std::vector<float>& x0, float a, float cRecip, int j, int n);
 	void SetBnd(int b, std::vector<float>& x);
+	void SetBnd(int b, std::vector<float>& x, int n);
+	void SetRowBnd(int b, std::vector<float>& x, int j, int n);
+	template <Boundary::Field AcrossX, Boundary::Field AcrossY> void SetBnd(std::vector<float>& x, int n);
+	template <Boundary::Field AcrossX, Boundary::Field AcrossY> void SetRowBnd(std::vector<float>& x, int j, int n);
+
+	void ReserveSolverScratch();
+	void Solve(Solver solver, int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n);
+	void ApplyOperator(std::vector<float>& out, std::vector<float>& x, float a, float c, int n);
+	void RedBlackSweep(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int n);
+	void SolveJacobi(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n);
+	void SolveConjugateGradient(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n);
+	void BuildGridLevels(int n);
+	int FindGridLevel(int fineN) const;
+	void VCycle(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int n);
 
-	void Diffuse(int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt, int iter);
+	static std::string CpuModel();
+	void ApplyTuning(const TuningConfig& config);
+	double TimePressureSolve(std::vector<float>& p, std::vector<float>& div, int repeats);
+	double PressureResidual(std::vector<float>& p, std::vector<float>& div, std::vector<float>& product);
+
+	DiffusionPath ChooseDiffusionPath(float a) const;
+	DiffusionPath Diffuse(int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt, int iter);
+	void PrepareTiles();
+	bool FuseDensityStep(float dt);
+	void DiffuseDensityTile(DiffusionPath path, float a, const TileScheduler::Rect& cells, std::vector<float>& out);
 	void ClearDivergence(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, std::vector<float>& div, int iter);
+	void DenseStep(float dt);
+	bool SparseStep(float dt);
+	void WakeTile(int index);
+	void SettleSparseTiles();
+	int VisitSparseTiles(float dt);
+	void SleepSparseTiles();
+	void ForSparseRects(const std::function<void(const TileScheduler::Rect&, int)>& body);
+	TileScheduler::Rect SparseInterior(const TileScheduler::Rect& rect) const;
+	DiffusionPath DiffuseSparse(int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt, int iter);
+	void SolveSparse(Solver solver, int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter);
+	void ClearDivergenceSparse(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, std::vector<float>& div, int iter);
+	void AdvectSparse(AdvectTarget* targets, int count, std::vector<float>& vx, std::vector<float>& vy, float dt);
+	void DivergenceTile(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, std::vector<float>& div, const TileScheduler::Rect& cells);
+	void SubtractGradientTile(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, const TileScheduler::Rect& cells, int slot);
+	void SolvePressure(std::vector<float>& p, std::vector<float>& div, int iter, int n);
+	void SolvePressureMixed(std::vector<float>& p, std::vector<float>& div, int iter, int n);
+	void SolveCoarsePressure(std::vector<float>& p, std::vector<float>& div, int iter);
 	void Advect(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt);
+	int BandRows(int fields) const;
+	void AdvectShared(AdvectTarget* targets, int count, std::vector<float>& vx, std::vector<float>& vy, float dt);
+	void AdvectSharedRow(AdvectTarget* targets, int count, std::vector<float>& vx, std::vector<float>& vy, float dt0, int j, int begin, int end, int origin);
+	void AdvectCubic(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt);
+	static float SampleCubic(const float* p, int stride, float fx, float fy);
+	void AdvectField(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt);
+	void LimitToSource(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt);
+
+	static bool SharesScratch(Solver solver);
+	void DiffuseVelocity(int bx, int by, std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& vx0, std::vector<float>& vy0, float dt);
+
+	float PeakSpeed();
+	void Step(float dt);
+	void UpdateVelocity(float dt);
+	void UpdateVelocityPressure(float dt);
+	void UpdateVorticityStreamfunction(float dt);
+	void VorticityRow(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& w, int j);
+	void StreamVelocityRow(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& psi, int j);
+
+	void UpdateFlip(float dt);
+	void SeedParticles();
+	void SortParticles();
+	void ParticleToGrid(std::vector<float>& vx, std::vector<float>& vy);
+	void GridToParticle(float dt);
+	float Sample(const std::vector<float>& f, float x, float y);
+
+	void UpdateStaggered(float dt);
+	void SetFaceBnd(std::vector<float>& u, std::vector<float>& v);
+	void ClearDivergenceStaggered(std::vector<float>& u, std::vector<float>& v, std::vector<float>& p, std::vector<float>& div, int iter);
+	void AdvectFaces(std::vector<float>& u, std::vector<float>& v, std::vector<float>& u0, std::vector<float>& v0, float dt);
+	void CentreVelocities(std::vector<float>& vx, std::vector<float>& vy);
+	float SampleFace(const std::vector<float>& f, float x, float y, float ox, float oy);
 
 public:
 	Fluid(const int& grid_size, const float& diffusion, const float& viscocity);
 
-	void AddDensity(int x, int y, float amount);
-	void AddVelocity(int x, int y, glm::vec2 amount);
+	void AddDensity(int x, int y, float amount) override;
+	void AddVelocity(int x, int y, glm::vec2 amount) override;
 
-	void Update(const float& dt);
-	void Draw(void* ptr);
+	void Update(const float& dt) override;
+	void Draw(void* ptr) override;
 
-	void Clean();
-	void SetGrayscaleSpace();
-	void SetHSVSpace();
-	void PrintDensity();
+	void Clean() override;
 
-	std::vector<glm::vec4> densityPixel;
+	DiffusionPath GetDiffusionPath(int b) const;
+	void SetProjectionCoarsening(int factor);
+	void SetMixedPrecisionPressure(bool enabled, int cycles = 4);
+	void SetFormulation(Formulation value);
+	void SetFlip(bool enabled, float ratio = 0.95f);
+	void SetStaggered(bool enabled);
+	void SetAdvectionScheme(AdvectionScheme scheme);
+	void SetInterpolation(Interpolation value);
+	void SetDiffusionSolver(Solver solver);
+	void SetPressureSolver(Solver solver);
+	void SetSparseTiles(bool enabled, float epsilon = 1e-4f);
+	void SetCflLimit(float limit, int substeps = 8);
+	void SetMaxFrameTime(float seconds);
+	void AutoTune(const std::string& cachePath, int repeats = 3);
 };
 
 Fluid::Fluid(const int& grid_size, const float& diffusion, const float& viscocity)
-	: size(grid_size), diff(diffusion), visc(viscocity), renderColorSpace(ColorSpace::GRAYSCALE) {
+	: Simulation(grid_size), diff(diffusion), visc(viscocity), scheduler(pool) {
 
 	pVx = std::vector<float>(size * size);
 	pVy = std::vector<float>(size * size);
 	Vx = std::vector<float>(size * size);
 	Vy = std::vector<float>(size * size);
 	s = std::vector<float>(size * size);
-	density = std::vector<float>(size * size);
-	densityPixel = std::vector<glm::vec4>(size * size);
 }
 
 int Fluid::IndexAt(int x, int y) {
+	return IndexAt(x, y, size);
+}
+
+int Fluid::IndexAt(int x, int y, int n) {
 	if (x < 0) { x = 0; }
-	if (x > size - 1) { x = size - 1; }
+	if (x > n - 1) { x = n - 1; }
 
 	if (y < 0) { y = 0; }
-	if (y > size - 1) { y = size - 1; }
+	if (y > n - 1) { y = n - 1; }
 
-	return (y * size) + x;
+	return (y * n) + x;
 }
 
 void Fluid::AddDensity(int x, int y, float amount) {
 	int index = IndexAt(x, y);
 	density[index] += amount;
+	WakeTile(index);
 }
 
 void Fluid::AddVelocity(int x, int y, glm::vec2 amount) {
 	int index = IndexAt(x, y);
+	if (staggered) {
+		// Split between the two faces of the cell along each axis
+		int right = IndexAt(x + 1, y), above = IndexAt(x, y + 1);
+		Vx[index] += 0.5f * amount.x;
+		Vx[right] += 0.5f * amount.x;
+		Vy[index] += 0.5f * amount.y;
+		Vy[above] += 0.5f * amount.y;
+
+		WakeTile(index);
+		WakeTile(right);
+		WakeTile(above);
+		if (peakSpeed >= 0.0f) {
+			float faces = std::max(std::max(std::fabs(Vx[index]), std::fabs(Vx[right])), std::max(std::fabs(Vy[index]), std::fabs(Vy[above])));
+			peakSpeed = std::max(peakSpeed, faces);
+		}
+		return;
+	}
 	Vx[index] += amount.x;
 	Vy[index] += amount.y;
+	WakeTile(index);
+	if (peakSpeed >= 0.0f)
+		peakSpeed = std::max(peakSpeed, std::max(std::fabs(Vx[index]), std::fabs(Vy[index])));
 }
 
 void Fluid::Update(const float& dt) {
-	Diffuse(1, pVx, Vx, visc, dt, 16);
-	Diffuse(2, pVy, Vy, visc, dt, 16);
+	// The first frame and a stalled clock have no time to simulate
+	if (!(dt > 0.0f))
+		return;
 
-	ClearDivergence(pVx, pVy, Vx, Vy, 16);
+	// A hitch is simulated as one long frame rather than all the time it lost
+	float frame = std::min(dt, maxFrameTime);
 
-	Advect(1, Vx, pVx, pVx, pVy, dt);
-	Advect(2, Vy, pVy, pVx, pVy, dt);
+	// The fewest substeps that keep every backtrace within cflLimit cells, up to maxSubsteps; past the cap the
+	// substeps just run above the limit, which costs accuracy and not stability. The ratio is clamped before the
+	// cast so an infinite or NaN speed cannot overflow it.
+	float cellsPerSecond = (static_cast<float>(size) - 2.0f) * PeakSpeed();
+	int steps = 1;
+	if (cflLimit > 0.0f) {
+		float ratio = frame * cellsPerSecond / cflLimit;
+		if (!(ratio <= static_cast<float>(maxSubsteps)))
+			ratio = static_cast<float>(maxSubsteps);
+		steps = std::max(static_cast<int>(std::ceil(ratio)), 1);
+	}
+	float step = frame / steps;
 
-	ClearDivergence(Vx, Vy, pVx, pVy, 16);
+	for (int k = 0; k < steps; k++) {
+		Step(step);
 
-	Diffuse(0, s, density, diff, dt, 16);
-	Advect(0, density, s, Vx, Vy, dt);
+		// Collocated projections record their speed as the gradient pass writes it; other layouts measure it again
+		if (formulation == Formulation::VELOCITY_PRESSURE && !staggered) {
+			peakSpeed = 0.0f;
+			for (float speed : tileSpeed)
+				peakSpeed = std::max(peakSpeed, speed);
+		} else {
+			peakSpeed = -1.0f;
+		}
+	}
 }
 
-void Fluid::Draw(void* ptr) {
-	for (int i = 0; i < size; ++i) {
-		for (int j = 0; j < size; ++j) {
-			int index = IndexAt(i, j);
-			densityPixel[index] = (renderColorSpace == ColorSpace::HSV)
-				? glm::vec4(glm::rgbColor(glm::vec3(density[index], 1.0f, 1.0f)), 1.0f)
-				: glm::vec4(glm::vec3(density[index]) / 255.0f, 1.0f);
+float Fluid::PeakSpeed() {
+	if (peakSpeed < 0.0f) {
+		peakSpeed = 0.0f;
+		for (int index = 0; index < size * size; index++)
+			peakSpeed = std::max(peakSpeed, std::max(std::fabs(Vx[index]), std::fabs(Vy[index])));
+	}
+	return peakSpeed;
+}
+
+void Fluid::Step(float dt) {
+	if (SparseStep(dt))
+		return;
+	DenseStep(dt);
+
+	// Still settled means a sparse step fell back: only its visited tiles can have moved past sparseEpsilon, so
+	// sleeping those again keeps the tiles current without settling the whole grid every dense frame
+	if (sparseSettled) {
+		SleepSparseTiles();
+		redrawAll = true;
+	}
+}
+
+void Fluid::DenseStep(float dt) {
+	// Implicit density diffusion only reads density, so it runs alongside the whole velocity step unless its solver
+	// needs the scratch the pressure solve uses. Advection then waits for the final velocity.
+	float a = dt * diff * (size - 2) * (size - 2);
+	bool diffuseAlongside = ChooseDiffusionPath(a) == DiffusionPath::IMPLICIT && !SharesScratch(diffusionSolver);
+
+	TaskGraph graph;
+	graph.Add([this, dt] { UpdateVelocity(dt); });
+	if (diffuseAlongside)
+		graph.Add([this, dt] { diffusionPath[0] = Diffuse(0, s, density, diff, dt, 16); });
+	graph.Run(pool);
+
+	if (!diffuseAlongside) {
+		if (FuseDensityStep(dt))
+			return;
+		diffusionPath[0] = Diffuse(0, s, density, diff, dt, 16);
+	}
+
+	if (staggered && formulation == Formulation::VELOCITY_PRESSURE && !flip) {
+		CentreVelocities(pVx, pVy);
+		AdvectField(0, density, s, pVx, pVy, dt);
+	} else {
+		AdvectField(0, density, s, Vx, Vy, dt);
+	}
+}
+
+void Fluid::UpdateVelocity(float dt) {
+	if (formulation == Formulation::VORTICITY_STREAMFUNCTION)
+		UpdateVorticityStreamfunction(dt);
+	else if (flip)
+		UpdateFlip(dt);
+	else if (staggered)
+		UpdateStaggered(dt);
+	else
+		UpdateVelocityPressure(dt);
+}
+
+bool Fluid::SharesScratch(Solver solver) {
+	// Gauss-Seidel and red-black relax the field in place; the others keep work vectors or grid levels on the Fluid
+	return solver == Solver::JACOBI || solver == Solver::MULTIGRID || solver == Solver::CONJUGATE_GRADIENT;
+}
+
+void Fluid::DiffuseVelocity(int bx, int by, std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& vx0, std::vector<float>& vy0, float dt) {
+	// The components diffuse independently, so they overlap unless an implicit solve has to share scratch
+	float a = dt * visc * (size - 2) * (size - 2);
+
+	TaskGraph graph;
+	int x = graph.Add([this, bx, &vx, &vx0, dt] { diffusionPath[1] = Diffuse(bx, vx, vx0, visc, dt, 16); });
+	int y = graph.Add([this, by, &vy, &vy0, dt] { diffusionPath[2] = Diffuse(by, vy, vy0, visc, dt, 16); });
+	if (ChooseDiffusionPath(a) == DiffusionPath::IMPLICIT && SharesScratch(diffusionSolver))
+		graph.Order(x, y);
+	graph.Run(pool);
+}
+
+void Fluid::UpdateVelocityPressure(float dt) {
+	DiffuseVelocity(1, 2, pVx, pVy, Vx, Vy, dt);
+
+	ClearDivergence(pVx, pVy, Vx, Vy, pressureIterations);
+
+	if (advectionScheme == AdvectionScheme::SEMI_LAGRANGIAN && interpolation == Interpolation::LINEAR) {
+		AdvectTarget velocity[2] = { { 1, &Vx, &pVx }, { 2, &Vy, &pVy } };
+		AdvectShared(velocity, 2, pVx, pVy, dt);
+	} else {
+		AdvectField(1, Vx, pVx, pVx, pVy, dt);
+		AdvectField(2, Vy, pVy, pVx, pVy, dt);
+	}
+
+	ClearDivergence(Vx, Vy, pVx, pVy, pressureIterations);
+}
+
+void Fluid::UpdateVorticityStreamfunction(float dt) {
+	// Vorticity is carried pre-scaled by h^2 so it is directly the right-hand side of the Poisson system
+	for (int j = 1; j < size - 1; j++)
+		VorticityRow(Vx, Vy, pVx, j);
+
+	diffusionPath[1] = diffusionPath[2] = Diffuse(0, pVy, pVx, visc, dt, 16);
+	AdvectField(0, pVx, pVy, Vx, Vy, dt);
+
+	// Odd reflection on every side keeps psi at zero on the walls, so no flow crosses them
+	Solve(pressureSolver, 3, psi, pVx, 1, 6, pressureIterations, size);
+
+	for (int j = 1; j < size - 1; j++)
+		StreamVelocityRow(Vx, Vy, psi, j);
+}
+
+void Fluid::UpdateFlip(float dt) {
+	// Vx/Vy still hold last step's grid velocity, so anything beyond flipU/flipV came from AddVelocity
+	SortParticles();
+	ParticleToGrid(pVx, pVy);
+	SetBnd(1, pVx);
+	SetBnd(2, pVy);
+	for (int index = 0; index < size * size; index++) {
+		float injectedX = Vx[index] - flipU[index];
+		float injectedY = Vy[index] - flipV[index];
+		flipU[index] = pVx[index];
+		flipV[index] = pVy[index];
+		pVx[index] += injectedX;
+		pVy[index] += injectedY;
+	}
+	SetBnd(1, pVx);
+	SetBnd(2, pVy);
+
+	DiffuseVelocity(1, 2, Vx, Vy, pVx, pVy, dt);
+
+	ClearDivergence(Vx, Vy, pVx, pVy, pressureIterations);
+
+	GridToParticle(dt);
+	std::copy(Vx.begin(), Vx.end(), flipU.begin());
+	std::copy(Vy.begin(), Vy.end(), flipV.begin());
+}
+
+void Fluid::SeedParticles() {
+	int perAxis = 1;
+	while ((perAxis + 1) * (perAxis + 1) <= particlesPerCell)
+		perAxis++;
+
+	particlePos.clear();
+	particleVel.clear();
+	float step = 1.0f / static_cast<float>(perAxis);
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++) {
+			for (int b = 0; b < perAxis; b++) {
+				for (int a = 0; a < perAxis; a++) {
+					float x = static_cast<float>(i) - 0.5f + (static_cast<float>(a) + 0.5f) * step;
+					float y = static_cast<float>(j) - 0.5f + (static_cast<float>(b) + 0.5f) * step;
+					particlePos.push_back(glm::vec2(x, y));
+					particleVel.push_back(glm::vec2(Sample(Vx, x, y), Sample(Vy, x, y)));
+				}
+			}
+		}
+	}
+}
+
+void Fluid::SortParticles() {
+	// Bins are rebuilt every step, so this is also where occupancy is kept in range: an interior cell the flow has
+	// emptied gets one particle at its centre carrying the grid velocity the particles last saw, and a crowded cell
+	// keeps at most twice the seeding density, which bounds the total however long the flow compresses.
+	int count = static_cast<int>(particlePos.size());
+	int crowd = 2 * particlesPerCell;
+	if (static_cast<int>(particleCell.size()) < count)
+		particleCell.resize(count);
+
+	std::fill(cellStart.begin(), cellStart.end(), 0);
+	for (int k = 0; k < count; k++) {
+		particleCell[k] = IndexAt(static_cast<int>(particlePos[k].x + 0.5f), static_cast<int>(particlePos[k].y + 0.5f));
+		cellStart[particleCell[k] + 1]++;
+	}
+	for (int c = 0; c < size * size; c++) {
+		int held = cellStart[c + 1];
+		int i = c % size, j = c / size;
+		if (held == 0 && i >= 1 && i <= size - 2 && j >= 1 && j <= size - 2)
+			held = 1;
+		cellStart[c + 1] = cellStart[c] + (held < crowd ? held : crowd);
+	}
+
+	int total = cellStart[size * size];
+	sortedPos.resize(total);
+	sortedVel.resize(total);
+	std::copy(cellStart.begin(), cellStart.end() - 1, cellCursor.begin());
+	for (int k = 0; k < count; k++) {
+		int c = particleCell[k];
+		if (cellCursor[c] == cellStart[c + 1])
+			continue;
+		int slot = cellCursor[c]++;
+		sortedPos[slot] = particlePos[k];
+		sortedVel[slot] = particleVel[k];
+	}
+	for (int c = 0; c < size * size; c++) {
+		if (cellCursor[c] == cellStart[c + 1])
+			continue;
+		sortedPos[cellCursor[c]] = glm::vec2(static_cast<float>(c % size), static_cast<float>(c / size));
+		sortedVel[cellCursor[c]] = glm::vec2(flipU[c], flipV[c]);
+	}
+	particlePos.swap(sortedPos);
+	particleVel.swap(sortedVel);
+}
+
+void Fluid::ParticleToGrid(std::vector<float>& vx, std::vector<float>& vy) {
+	// Each cell gathers the tent-weighted velocities of the particles in its 3x3 block, so rows are independent
+	pool.ParallelFor(1, size - 1, 8, [this, &vx, &vy](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			for (int i = 1; i < size - 1; i++) {
+				float sumX = 0.0f, sumY = 0.0f, sumW = 0.0f;
+				for (int nj = j - 1; nj <= j + 1; nj++) {
+					int first = cellStart[IndexAt(i - 1, nj)];
+					int last = cellStart[IndexAt(i + 1, nj) + 1];
+					for (int k = first; k < last; k++) {
+						float wx = 1.0f - std::fabs(particlePos[k].x - static_cast<float>(i));
+						float wy = 1.0f - std::fabs(particlePos[k].y - static_cast<float>(j));
+						float w = (wx > 0.0f ? wx : 0.0f) * (wy > 0.0f ? wy : 0.0f);
+						sumX += w * particleVel[k].x;
+						sumY += w * particleVel[k].y;
+						sumW += w;
+					}
+				}
+
+				int index = IndexAt(i, j);
+				vx[index] = sumW > 0.0f ? sumX / sumW : flipU[index];
+				vy[index] = sumW > 0.0f ? sumY / sumW : flipV[index];
+			}
+		}
+	});
+}
+
+void Fluid::GridToParticle(float dt) {
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+	float lo = 0.5f;
+	float hi = static_cast<float>(size) - 1.5f;
+
+	pool.ParallelFor(0, static_cast<int>(particlePos.size()), 4096, [this, dt0, lo, hi](int begin, int end) {
+		for (int k = begin; k < end; k++) {
+			glm::vec2& pos = particlePos[k];
+			glm::vec2& vel = particleVel[k];
+
+			glm::vec2 grid(Sample(Vx, pos.x, pos.y), Sample(Vy, pos.x, pos.y));
+			glm::vec2 change = grid - glm::vec2(Sample(flipU, pos.x, pos.y), Sample(flipV, pos.x, pos.y));
+			vel = flipRatio * (vel + change) + (1.0f - flipRatio) * grid;
+
+			// Midpoint step through the divergence-free grid field
+			glm::vec2 mid = pos + 0.5f * dt0 * grid;
+			pos += dt0 * glm::vec2(Sample(Vx, mid.x, mid.y), Sample(Vy, mid.x, mid.y));
+
+			// Particles pushed against a wall lose the normal component there, as the grid velocity does
+			if (pos.x < lo || pos.x > hi) { pos.x = glm::clamp(pos.x, lo, hi); vel.x = 0.0f; }
+			if (pos.y < lo || pos.y > hi) { pos.y = glm::clamp(pos.y, lo, hi); vel.y = 0.0f; }
+		}
+	});
+}
+
+float Fluid::Sample(const std::vector<float>& f, float x, float y) {
+	float hi = static_cast<float>(size) - 1.5f;
+	if (x < 0.5f) { x = 0.5f; }
+	if (x > hi) { x = hi; }
+	if (y < 0.5f) { y = 0.5f; }
+	if (y > hi) { y = hi; }
+
+	int i0 = static_cast<int>(x);
+	int j0 = static_cast<int>(y);
+	float s1 = x - static_cast<float>(i0);
+	float t1 = y - static_cast<float>(j0);
+
+	int index = (j0 * size) + i0;
+	return (1.0f - s1) * ((1.0f - t1) * f[index] + t1 * f[index + size]) +
+		s1 * ((1.0f - t1) * f[index + 1] + t1 * f[index + size + 1]);
+}
+
+void Fluid::UpdateStaggered(float dt) {
+	DiffuseVelocity(0, 0, pVx, pVy, Vx, Vy, dt);
+	SetFaceBnd(pVx, pVy);
+
+	ClearDivergenceStaggered(pVx, pVy, Vx, Vy, pressureIterations);
+
+	AdvectFaces(Vx, Vy, pVx, pVy, dt);
+
+	ClearDivergenceStaggered(Vx, Vy, pVx, pVy, pressureIterations);
+}
+
+void Fluid::SetFaceBnd(std::vector<float>& u, std::vector<float>& v) {
+	// Wall faces carry no flow; the faces outside the walls copy their neighbour (free slip)
+	for (int j = 0; j < size; j++) {
+		u[IndexAt(0, j)] = 0.0f;
+		u[IndexAt(1, j)] = 0.0f;
+		u[IndexAt(size - 1, j)] = 0.0f;
+	}
+	for (int i = 0; i < size; i++) {
+		v[IndexAt(i, 0)] = 0.0f;
+		v[IndexAt(i, 1)] = 0.0f;
+		v[IndexAt(i, size - 1)] = 0.0f;
+	}
+
+	for (int i = 2; i < size - 1; i++) {
+		u[IndexAt(i, 0)] = u[IndexAt(i, 1)];
+		u[IndexAt(i, size - 1)] = u[IndexAt(i, size - 2)];
+	}
+	for (int j = 2; j < size - 1; j++) {
+		v[IndexAt(0, j)] = v[IndexAt(1, j)];
+		v[IndexAt(size - 1, j)] = v[IndexAt(size - 2, j)];
+	}
+}
+
+void Fluid::ClearDivergenceStaggered(std::vector<float>& u, std::vector<float>& v, std::vector<float>& p, std::vector<float>& div, int iter) {
+	// Compact stencils: each cell sees only its own four faces, so no checkerboard mode slips through
+	for (int j = 1; j < size - 1; j++) {
+		const float* uRow = &u[j * size];
+		const float* vRow = &v[j * size];
+		const float* vAbove = &v[(j + 1) * size];
+		float* d = &div[j * size];
+		float* q = &p[j * size];
+
+		for (int i = 1; i < size - 1; i++) {
+			d[i] = -(uRow[i + 1] - uRow[i] + vAbove[i] - vRow[i]) / size;
+			q[i] = 0;
+		}
+
+		SetRowBnd(0, div, j, size);
+		SetRowBnd(0, p, j, size);
+	}
+
+	if (projectionFactor > 1)
+		SolveCoarsePressure(p, div, iter);
+	else
+		SolvePressure(p, div, iter, size);
+
+	for (int j = 1; j < size - 1; j++) {
+		const float* q = &p[j * size];
+		const float* qBelow = &p[(j - 1) * size];
+		float* uRow = &u[j * size];
+		float* vRow = &v[j * size];
+
+		for (int i = 2; i < size - 1; i++)
+			uRow[i] -= (q[i] - q[i - 1]) * size;
+		if (j >= 2) {
+			for (int i = 1; i < size - 1; i++)
+				vRow[i] -= (q[i] - qBelow[i]) * size;
+		}
+	}
+	SetFaceBnd(u, v);
+}
+
+void Fluid::AdvectFaces(std::vector<float>& u, std::vector<float>& v, std::vector<float>& u0, std::vector<float>& v0, float dt) {
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 2; i < size - 1; i++) {
+			// Face (i - 1/2, j): its own u, and v averaged from the four surrounding v faces
+			float fu = u0[IndexAt(i, j)];
+			float fv = 0.25f * (v0[IndexAt(i - 1, j)] + v0[IndexAt(i, j)] + v0[IndexAt(i - 1, j + 1)] + v0[IndexAt(i, j + 1)]);
+			float x = static_cast<float>(i) - 0.5f - dt0 * fu;
+			float y = static_cast<float>(j) - dt0 * fv;
+			u[IndexAt(i, j)] = SampleFace(u0, x, y, -0.5f, 0.0f);
+		}
+	}
+
+	for (int j = 2; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++) {
+			float fu = 0.25f * (u0[IndexAt(i, j - 1)] + u0[IndexAt(i + 1, j - 1)] + u0[IndexAt(i, j)] + u0[IndexAt(i + 1, j)]);
+			float fv = v0[IndexAt(i, j)];
+			float x = static_cast<float>(i) - dt0 * fu;
+			float y = static_cast<float>(j) - 0.5f - dt0 * fv;
+			v[IndexAt(i, j)] = SampleFace(v0, x, y, 0.0f, -0.5f);
+		}
+	}
+	SetFaceBnd(u, v);
+}
+
+void Fluid::CentreVelocities(std::vector<float>& vx, std::vector<float>& vy) {
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++) {
+			vx[IndexAt(i, j)] = 0.5f * (Vx[IndexAt(i, j)] + Vx[IndexAt(i + 1, j)]);
+			vy[IndexAt(i, j)] = 0.5f * (Vy[IndexAt(i, j)] + Vy[IndexAt(i, j + 1)]);
 		}
 	}
-	memcpy(ptr, densityPixel.data(), densityPixel.size() * sizeof(glm::vec4));
+	SetBnd(1, vx);
+	SetBnd(2, vy);
+}
+
+float Fluid::SampleFace(const std::vector<float>& f, float x, float y, float ox, float oy) {
+	// (x, y) is a position in cell-centre coordinates and (ox, oy) where f's samples sit relative to the centres
+	float hi = static_cast<float>(size) - 1.5f;
+	if (x < 0.5f) { x = 0.5f; }
+	if (x > hi) { x = hi; }
+	if (y < 0.5f) { y = 0.5f; }
+	if (y > hi) { y = hi; }
+	x -= ox;
+	y -= oy;
+
+	int i0 = static_cast<int>(x);
+	int j0 = static_cast<int>(y);
+	if (i0 > size - 2) { i0 = size - 2; }
+	if (j0 > size - 2) { j0 = size - 2; }
+	float s1 = x - static_cast<float>(i0);
+	float t1 = y - static_cast<float>(j0);
+
+	int index = (j0 * size) + i0;
+	return (1.0f - s1) * ((1.0f - t1) * f[index] + t1 * f[index + size]) +
+		s1 * ((1.0f - t1) * f[index + 1] + t1 * f[index + size + 1]);
+}
+
+void Fluid::VorticityRow(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& w, int j) {
+	Stencil::Field u(vx, size), v(vy, size);
+	Stencil::EvaluateRow(j, size, Stencil::Assign(w, 0.5f * (v.At(1, 0) - v.At(-1, 0) - u.At(0, 1) + u.At(0, -1)) / size));
+
+	SetRowBnd(0, w, j, size);
+}
+
+void Fluid::StreamVelocityRow(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& psi, int j) {
+	Stencil::Field q(psi, size);
+	Stencil::EvaluateRow(j, size,
+		Stencil::Assign(vx, 0.5f * (q.At(0, 1) - q.At(0, -1)) * size),
+		Stencil::Assign(vy, -0.5f * (q.At(1, 0) - q.At(-1, 0)) * size));
+
+	SetRowBnd(1, vx, j, size);
+	SetRowBnd(2, vy, j, size);
 }
 
 void Fluid::Clean() {
+	Simulation::Clean();
 	std::fill(pVx.begin(), pVx.end(), 0.0f);
 	std::fill(pVy.begin(), pVy.end(), 0.0f);
 	std::fill(Vx.begin(), Vx.end(), 0.0f);
 	std::fill(Vy.begin(), Vy.end(), 0.0f);
 	std::fill(s.begin(), s.end(), 0.0f);
-	std::fill(density.begin(), density.end(), 0.0f);
-	std::fill(densityPixel.begin(), densityPixel.end(), glm::vec4(0.0f));
+	std::fill(psi.begin(), psi.end(), 0.0f);
+	std::fill(particleVel.begin(), particleVel.end(), glm::vec2(0.0f));
+	std::fill(flipU.begin(), flipU.end(), 0.0f);
+	std::fill(flipV.begin(), flipV.end(), 0.0f);
+	sparseSettled = false;
+	peakSpeed = 0.0f;
 }
 
-void Fluid::SetGrayscaleSpace() {
-	renderColorSpace = ColorSpace::GRAYSCALE;
-}
+void Fluid::Draw(void* ptr) {
+	// Sleeping tiles have not changed since they were last drawn, so only the visited ones are refreshed; the
+	// mapped buffer keeps the rest from the previous frame
+	if (!sparse || !sparseSettled || redrawAll) {
+		Simulation::Draw(ptr);
+		return;
+	}
 
-void Fluid::SetHSVSpace() {
-	renderColorSpace = ColorSpace::HSV;
+	glm::vec4* pixels = static_cast<glm::vec4*>(ptr);
+	for (const TileScheduler::Rect& rect : sparseRects) {
+		for (int j = rect.y0; j < rect.y1; j++) {
+			int begin = j * size + rect.x0, end = j * size + rect.x1;
+			for (int index = begin; index < end; index++)
+				densityPixel[index] = Pixel(density[index]);
+			memcpy(pixels + begin, densityPixel.data() + begin, (end - begin) * sizeof(glm::vec4));
+		}
+	}
 }
 
 void Fluid::SetBnd(int b, std::vector<float>& x) {
-	for (int i = 1; i < size - 1; i++) {
-		x[IndexAt(i, 0)] = b == 2 ? -x[IndexAt(i, 1)] : x[IndexAt(i, 1)];
-		x[IndexAt(i, size - 1)] = b == 2 ? -x[IndexAt(i, size - 2)] : x[IndexAt(i, size - 2)];
+	SetBnd(b, x, size);
+}
+
+void Fluid::SetBnd(int b, std::vector<float>& x, int n) {
+	// Dispatch once on b; the pass below then has each side's rule inlined from the Walls policies
+	switch (b) {
+	case 1:
+		SetBnd<Boundary::Field::NORMAL, Boundary::Field::TANGENTIAL>(x, n);
+		break;
+
+	case 2:
+		SetBnd<Boundary::Field::TANGENTIAL, Boundary::Field::NORMAL>(x, n);
+		break;
+
+	case 3:
+		SetBnd<Boundary::Field::NORMAL, Boundary::Field::NORMAL>(x, n);
+		break;
+
+	default:
+		SetBnd<Boundary::Field::SCALAR, Boundary::Field::SCALAR>(x, n);
+		break;
 	}
+}
 
-	for (int j = 1; j < size - 1; j++) {
-		x[IndexAt(0, j)] = b == 1 ? -x[IndexAt(1, j)] : x[IndexAt(1, j)];
-		x[IndexAt(size - 1, j)] = b == 1 ? -x[IndexAt(size - 2, j)] : x[IndexAt(size - 2, j)];
+template <Boundary::Field AcrossX, Boundary::Field AcrossY>
+void Fluid::SetBnd(std::vector<float>& x, int n) {
+	for (int i = 1; i < n - 1; i++) {
+		x[IndexAt(i, 0, n)] = Walls::Bottom::Ghost<AcrossY, float>(x[IndexAt(i, 1, n)], x[IndexAt(i, n - 2, n)], 0.0f);
+		x[IndexAt(i, n - 1, n)] = Walls::Top::Ghost<AcrossY, float>(x[IndexAt(i, n - 2, n)], x[IndexAt(i, 1, n)], 0.0f);
+	}
+
+	for (int j = 1; j < n - 1; j++) {
+		x[IndexAt(0, j, n)] = Walls::Left::Ghost<AcrossX, float>(x[IndexAt(1, j, n)], x[IndexAt(n - 2, j, n)], 0.0f);
+		x[IndexAt(n - 1, j, n)] = Walls::Right::Ghost<AcrossX, float>(x[IndexAt(n - 2, j, n)], x[IndexAt(1, j, n)], 0.0f);
 	}
 
-	x[IndexAt(0, 0)] = 0.33f * (x[IndexAt(1, 0)]
-		+ x[IndexAt(0, 1)]
-		+ x[IndexAt(0, 0)]);
-	x[IndexAt(0, size - 1)] = 0.33f * (x[IndexAt(1, size - 1)]
-		+ x[IndexAt(0, size - 2)]
-		+ x[IndexAt(0, size - 1)]);
-	x[IndexAt(size - 1, 0)] = 0.33f * (x[IndexAt(size - 2, 0)]
-		+ x[IndexAt(size - 1, 1)]
-		+ x[IndexAt(size - 1, 0)]);
-	x[IndexAt(size - 1, size - 1)] = 0.33f * (x[IndexAt(size - 2, size - 1)]
-		+ x[IndexAt(size - 1, size - 2)]
-		+ x[IndexAt(size - 1, size - 1)]);
+	x[IndexAt(0, 0, n)] = 0.33f * (x[IndexAt(1, 0, n)]
+		+ x[IndexAt(0, 1, n)]
+		+ x[IndexAt(0, 0, n)]);
+	x[IndexAt(0, n - 1, n)] = 0.33f * (x[IndexAt(1, n - 1, n)]
+		+ x[IndexAt(0, n - 2, n)]
+		+ x[IndexAt(0, n - 1, n)]);
+	x[IndexAt(n - 1, 0, n)] = 0.33f * (x[IndexAt(n - 2, 0, n)]
+		+ x[IndexAt(n - 1, 1, n)]
+		+ x[IndexAt(n - 1, 0, n)]);
+	x[IndexAt(n - 1, n - 1, n)] = 0.33f * (x[IndexAt(n - 2, n - 1, n)]
+		+ x[IndexAt(n - 1, n - 2, n)]
+		+ x[IndexAt(n - 1, n - 1, n)]);
 }
 
 void Fluid::LinSolve(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter) {
+	LinSolve(b, x, x0, a, c, iter, size);
+}
+
+void Fluid::LinSolve(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n) {
+	float cRecip = 1.0f / c;
+
+	// Sweep k can relax row j as soon as sweep k - 1 is done with row j + 1, so each sweep trails the
+	// previous one by two rows and a band of about 2 * depth rows carries depth sweeps through the cache.
+	int bandRows = wavefrontCacheBytes / (2 * n * static_cast<int>(sizeof(float)));
+	int depth = bandRows / 2 - 1;
+	if (depth > iter) { depth = iter; }
+	if (depth < 1) { depth = 1; }
+
+	for (int k0 = 0; k0 < iter; k0 += depth) {
+		int sweeps = (iter - k0 < depth) ? iter - k0 : depth;
+		for (int t = 1; t <= n - 2 + 2 * (sweeps - 1); t++) {
+			for (int k = 0; k < sweeps; k++) {
+				int j = t - 2 * k;
+				if (j >= 1 && j <= n - 2)
+					LinSolveRow(b, x, x0, a, cRecip, j, n);
+			}
+		}
+	}
+}
+
+void Fluid::LinSolveRow(int b, std::vector<float>& x, std::vector<float>& x0, float a, float cRecip, int j, int n) {
+	float* row = &x[j * n];
+	const float* below = row - n;
+	const float* above = row + n;
+	const float* src = &x0[j * n];
+
+	for (int i = 1; i < n - 1; i++)
+		row[i] = (src[i] + a * (row[i + 1] + row[i - 1] + above[i] + below[i] + row[i] + row[i])) * cRecip;
+
+	SetRowBnd(b, x, j, n);
+}
+
+void Fluid::SetRowBnd(int b, std::vector<float>& x, int j, int n) {
+	switch (b) {
+	case 1:
+		SetRowBnd<Boundary::Field::NORMAL, Boundary::Field::TANGENTIAL>(x, j, n);
+		break;
+
+	case 2:
+		SetRowBnd<Boundary::Field::TANGENTIAL, Boundary::Field::NORMAL>(x, j, n);
+		break;
+
+	case 3:
+		SetRowBnd<Boundary::Field::NORMAL, Boundary::Field::NORMAL>(x, j, n);
+		break;
+
+	default:
+		SetRowBnd<Boundary::Field::SCALAR, Boundary::Field::SCALAR>(x, j, n);
+		break;
+	}
+}
+
+template <Boundary::Field AcrossX, Boundary::Field AcrossY>
+void Fluid::SetRowBnd(std::vector<float>& x, int j, int n) {
+	// The boundary cells fed by interior row j, exactly as SetBnd would leave them once every row is final
+	float* row = &x[j * n];
+	row[0] = Walls::Left::Ghost<AcrossX, float>(row[1], row[n - 2], 0.0f);
+	row[n - 1] = Walls::Right::Ghost<AcrossX, float>(row[n - 2], row[1], 0.0f);
+
+	if (j == 1) {
+		float* edge = &x[0];
+		for (int i = 1; i < n - 1; i++)
+			edge[i] = Walls::Bottom::Ghost<AcrossY, float>(row[i], 0.0f, 0.0f);
+		edge[0] = 0.33f * (edge[1] + row[0] + edge[0]);
+		edge[n - 1] = 0.33f * (edge[n - 2] + row[n - 1] + edge[n - 1]);
+	}
+
+	if (j == n - 2) {
+		float* edge = &x[(n - 1) * n];
+		for (int i = 1; i < n - 1; i++)
+			edge[i] = Walls::Top::Ghost<AcrossY, float>(row[i], 0.0f, 0.0f);
+		edge[0] = 0.33f * (edge[1] + row[0] + edge[0]);
+		edge[n - 1] = 0.33f * (edge[n - 2] + row[n - 1] + edge[n - 1]);
+	}
+}
+
+void Fluid::Solve(Solver solver, int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n) {
+	// Dispatch once per solve; each backend runs its own loops, so nothing is virtual per cell.
+	// iter is a sweep count for the relaxations, an iteration cap for CG, and four sweeps' worth of V-cycle.
+	switch (solver) {
+	case Solver::RED_BLACK:
+		for (int k = 0; k < iter; k++)
+			RedBlackSweep(b, x, x0, a, c, n);
+		break;
+
+	case Solver::JACOBI:
+		SolveJacobi(b, x, x0, a, c, iter, n);
+		break;
+
+	case Solver::MULTIGRID:
+		BuildGridLevels(n);
+		for (int k = 0; k < (iter + 3) / 4; k++)
+			VCycle(b, x, x0, a, c, n);
+		break;
+
+	case Solver::CONJUGATE_GRADIENT:
+		SolveConjugateGradient(b, x, x0, a, c, iter, n);
+		break;
+
+	default:
+		LinSolve(b, x, x0, a, c, iter, n);
+		break;
+	}
+}
+
+void Fluid::ApplyOperator(std::vector<float>& out, std::vector<float>& x, float a, float c, int n) {
+	// Interior rows of A x, reading the boundary cells of x as they stand
+	pool.ParallelFor(1, n - 1, 16, [&out, &x, a, c, n](int begin, int end) {
+		Stencil::Field v(x, n);
+		for (int j = begin; j < end; j++)
+			Stencil::EvaluateRow(j, n, Stencil::Assign(out, c * v - a * (v.At(1, 0) + v.At(-1, 0) + v.At(0, 1) + v.At(0, -1) + v + v)));
+	});
+}
+
+void Fluid::RedBlackSweep(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int n) {
+	// Same update as LinSolveRow, but a cell's four neighbours all have the other colour, so each half-sweep is parallel
+	float cRecip = 1.0f / c;
+	for (int color = 0; color < 2; color++) {
+		pool.ParallelFor(1, n - 1, 16, [&x, &x0, a, cRecip, n, color](int begin, int end) {
+			for (int j = begin; j < end; j++) {
+				float* row = &x[j * n];
+				const float* below = row - n;
+				const float* above = row + n;
+				const float* src = &x0[j * n];
+				for (int i = 1 + ((1 + j + color) & 1); i < n - 1; i += 2)
+					row[i] = (src[i] + a * (row[i + 1] + row[i - 1] + above[i] + below[i] + row[i] + row[i])) * cRecip;
+			}
+		});
+		SetBnd(b, x, n);
+	}
+}
+
+void Fluid::SolveJacobi(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n) {
+	// Ping-pongs between x and solverScratch; the self term makes it a damped Jacobi that converges for every a
 	float cRecip = 1.0f / c;
 	for (int k = 0; k < iter; k++) {
-		for (int j = 1; j < size - 1; j++) {
-			for (int i = 1; i < size - 1; i++) {
-				x[IndexAt(i, j)] = (x0[IndexAt(i, j)] + a
-					* (x[IndexAt(i + 1, j)]
-						+ x[IndexAt(i - 1, j)]
-						+ x[IndexAt(i, j + 1)]
-						+ x[IndexAt(i, j - 1)]
-						+ x[IndexAt(i, j)]
-						+ x[IndexAt(i, j)]
-						)) * cRecip;
+		std::vector<float>& from = (k % 2 == 0) ? x : solverScratch;
+		std::vector<float>& to = (k % 2 == 0) ? solverScratch : x;
+
+		pool.ParallelFor(1, n - 1, 16, [&from, &to, &x0, a, cRecip, n](int begin, int end) {
+			Stencil::Field v(from, n), src(x0, n);
+			for (int j = begin; j < end; j++)
+				Stencil::EvaluateRow(j, n, Stencil::Assign(to, (src + a * (v.At(1, 0) + v.At(-1, 0) + v.At(0, 1) + v.At(0, -1) + v + v)) * cRecip));
+		});
+		SetBnd(b, to, n);
+	}
+
+	if (iter % 2 == 1)
+		std::copy(solverScratch.begin(), solverScratch.begin() + n * n, x.begin());
+}
+
+void Fluid::SolveConjugateGradient(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter, int n) {
+	// Boundary cells mirror their neighbour (negated for b), which folds into the diagonal and keeps A symmetric.
+	// The pure Neumann pressure system is only semi-definite, so the loop also stops on a non-positive curvature.
+	std::vector<float>& r = solverScratch;
+	std::vector<float>& d = solverDirection;
+	std::vector<float>& q = solverProduct;
+
+	SetBnd(b, x, n);
+	ApplyOperator(q, x, a, c, n);
+
+	double rr = 0.0;
+	for (int j = 1; j < n - 1; j++) {
+		for (int i = 1; i < n - 1; i++) {
+			int index = IndexAt(i, j, n);
+			r[index] = x0[index] - q[index];
+			d[index] = r[index];
+			rr += static_cast<double>(r[index]) * r[index];
+		}
+	}
+	double tolerance = rr * 1e-12;
+
+	for (int k = 0; k < iter && rr > tolerance; k++) {
+		SetBnd(b, d, n);
+		ApplyOperator(q, d, a, c, n);
+
+		double dq = 0.0;
+		for (int j = 1; j < n - 1; j++) {
+			for (int i = 1; i < n - 1; i++)
+				dq += static_cast<double>(d[IndexAt(i, j, n)]) * q[IndexAt(i, j, n)];
+		}
+		if (dq <= 0.0)
+			break;
+
+		float alpha = static_cast<float>(rr / dq);
+		double next = 0.0;
+		for (int j = 1; j < n - 1; j++) {
+			for (int i = 1; i < n - 1; i++) {
+				int index = IndexAt(i, j, n);
+				x[index] += alpha * d[index];
+				r[index] -= alpha * q[index];
+				next += static_cast<double>(r[index]) * r[index];
 			}
 		}
+
+		float beta = static_cast<float>(next / rr);
+		rr = next;
+		for (int j = 1; j < n - 1; j++) {
+			for (int i = 1; i < n - 1; i++)
+				d[IndexAt(i, j, n)] = r[IndexAt(i, j, n)] + beta * d[IndexAt(i, j, n)];
+		}
+	}
+	SetBnd(b, x, n);
+}
+
+int Fluid::FindGridLevel(int fineN) const {
+	for (int l = 0; l < static_cast<int>(gridLevels.size()); l++) {
+		if (gridLevels[l].fineN == fineN)
+			return l;
+	}
+	return -1;
+}
+
+void Fluid::BuildGridLevels(int n) {
+	// Built before a solve starts, since VCycle holds references into gridLevels while it recurses
+	while (n - 2 > 4) {
+		int coarse = (n - 2 + 1) / 2 + 2;
+		if (FindGridLevel(n) < 0)
+			gridLevels.push_back({ n, coarse, std::vector<float>(coarse * coarse), std::vector<float>(coarse * coarse), std::vector<float>(n * n) });
+		n = coarse;
+	}
+}
+
+void Fluid::VCycle(int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int n) {
+	if (n - 2 <= 4) {
+		for (int k = 0; k < 16; k++)
+			RedBlackSweep(b, x, x0, a, c, n);
+		return;
+	}
+
+	RedBlackSweep(b, x, x0, a, c, n);
+	RedBlackSweep(b, x, x0, a, c, n);
+
+	GridLevel& level = gridLevels[FindGridLevel(n)];
+	const int m = level.n;
+
+	// Restrict the residual as the mean of each 2x2 block. a scales with 1 / h^2, so the coarse system keeps
+	// the identity part c - 6a and takes a quarter of the coupling.
+	ApplyOperator(level.residual, x, a, c, n);
+	std::fill(level.rhs.begin(), level.rhs.end(), 0.0f);
+	for (int j = 1; j < n - 1; j++) {
+		for (int i = 1; i < n - 1; i++) {
+			int index = IndexAt(i, j, n);
+			level.rhs[IndexAt(1 + (i - 1) / 2, 1 + (j - 1) / 2, m)] += 0.25f * (x0[index] - level.residual[index]);
+		}
+	}
+
+	float coarseA = 0.25f * a;
+	float coarseC = (c - 6.0f * a) + 6.0f * coarseA;
+	std::fill(level.x.begin(), level.x.end(), 0.0f);
+	VCycle(b, level.x, level.rhs, coarseA, coarseC, m);
+	SetBnd(b, level.x, m);
+
+	// Bilinear prolongation, as in SolveCoarsePressure with a factor of two
+	for (int j = 1; j < n - 1; j++) {
+		float y = (static_cast<float>(j) + 0.5f) * 0.5f;
+		int j0 = static_cast<int>(y);
+		float t1 = y - static_cast<float>(j0);
+		float t0 = 1.0f - t1;
+		for (int i = 1; i < n - 1; i++) {
+			float px = (static_cast<float>(i) + 0.5f) * 0.5f;
+			int i0 = static_cast<int>(px);
+			float s1 = px - static_cast<float>(i0);
+			float s0 = 1.0f - s1;
+
+			x[IndexAt(i, j, n)] +=
+				s0 * (t0 * level.x[IndexAt(i0, j0, m)] + t1 * level.x[IndexAt(i0, j0 + 1, m)]) +
+				s1 * (t0 * level.x[IndexAt(i0 + 1, j0, m)] + t1 * level.x[IndexAt(i0 + 1, j0 + 1, m)]);
+		}
+	}
+	SetBnd(b, x, n);
+
+	RedBlackSweep(b, x, x0, a, c, n);
+	RedBlackSweep(b, x, x0, a, c, n);
+}
+
+Fluid::DiffusionPath Fluid::ChooseDiffusionPath(float a) const {
+	// The implicit step damps a Laplacian mode with eigenvalue k in [0, 8] by 1 / (1 + a * k).
+	// A plain copy misses that by at most 8a and one explicit pass (1 - a * k) by at most (8a)^2.
+	if (8.0f * a <= diffusionTolerance)
+		return DiffusionPath::COPY;
+	if (64.0f * a * a <= diffusionTolerance)
+		return DiffusionPath::EXPLICIT;
+	return DiffusionPath::IMPLICIT;
+}
+
+Fluid::DiffusionPath Fluid::Diffuse(int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt, int iter) {
+	float a = dt * diff * (size - 2) * (size - 2);
+	DiffusionPath path = ChooseDiffusionPath(a);
+
+	if (path == DiffusionPath::COPY) {
+		std::copy(x0.begin(), x0.end(), x.begin());
+		SetBnd(b, x);
+		return DiffusionPath::COPY;
+	}
+
+	if (path == DiffusionPath::EXPLICIT) {
+		Stencil::Field v(x0, size);
+		for (int j = 1; j < size - 1; j++)
+			Stencil::EvaluateRow(j, size, Stencil::Assign(x, v + a * (v.At(1, 0) + v.At(-1, 0) + v.At(0, 1) + v.At(0, -1) - 4.0f * v)));
 		SetBnd(b, x);
+		return DiffusionPath::EXPLICIT;
 	}
+
+	Solve(diffusionSolver, b, x, x0, a, 1 + 6 * a, iter, size);
+	return DiffusionPath::IMPLICIT;
+}
+
+void Fluid::PrepareTiles() {
+	// Slots and band heights follow the pool's thread count and the cache budget, both of which AutoTune may change.
+	// Five fields are live in a tile: the density step's source, scratch, output and two velocity components.
+	scheduler.SetTileRows(BandRows(5));
+	int slots = scheduler.Slots();
+	int window = (2 * scheduler.TileRows() + 2) * size;
+	if (static_cast<int>(tileScratch.size()) < slots)
+		tileScratch.resize(slots);
+	for (std::vector<float>& scratch : tileScratch) {
+		if (static_cast<int>(scratch.size()) < window)
+			scratch.resize(window);
+	}
+	if (static_cast<int>(tileSpeed.size()) != slots)
+		tileSpeed.assign(slots, 0.0f);
 }
 
-void Fluid::Diffuse(int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt, int iter) {
+bool Fluid::FuseDensityStep(float dt) {
+	// Copy or explicit diffusion followed by semi-Lagrangian advection is a single tile chain: each tile diffuses the
+	// cells its backtraces can reach into its thread's scratch and advects straight out of it, so the diffused field
+	// never goes through memory. The reach is bounded by the speed the last projection's gradient tiles saw.
+	if (formulation != Formulation::VELOCITY_PRESSURE || flip || staggered)
+		return false;
+	if (advectionScheme != AdvectionScheme::SEMI_LAGRANGIAN || interpolation != Interpolation::LINEAR)
+		return false;
+
 	float a = dt * diff * (size - 2) * (size - 2);
-	LinSolve(b, x, x0, a, 1 + 6 * a, iter);
+	DiffusionPath path = ChooseDiffusionPath(a);
+	if (path == DiffusionPath::IMPLICIT)
+		return false;
+
+	float speed = 0.0f;
+	for (float tile : tileSpeed)
+		speed = std::max(speed, tile);
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+	float trace = std::ceil(dt0 * speed);
+	if (!(trace + 2.0f <= static_cast<float>(scheduler.MaxHalo())))
+		return false;
+	int reach = static_cast<int>(trace) + 2;
+
+	// The chain reads density and writes the advected field into s, so the two swap once every tile is done. The
+	// boundary pass then matches Diffuse and Advect: density's corners feed SetBnd, and s keeps the diffused corners.
+	PrepareTiles();
+	scheduler.Run(size, {
+		{ 0, [this, path, a](const TileScheduler::Rect& cells, int slot) {
+			DiffuseDensityTile(path, a, cells, tileScratch[slot]);
+		} },
+		{ reach, [this, dt0, reach](const TileScheduler::Rect& cells, int slot) {
+			// The scratch starts at the first row of the window the diffusion stage was given
+			int origin = std::max(cells.y0 - reach, 0) * size;
+			AdvectTarget target = { 0, &s, &tileScratch[slot] };
+			for (int j = cells.y0; j < cells.y1; j++)
+				AdvectSharedRow(&target, 1, Vx, Vy, dt0, j, cells.x0, cells.x1, origin);
+		} },
+		{ TileScheduler::GLOBAL, [this, path, a](const TileScheduler::Rect&, int) {
+			const int n = size;
+			const int corners[4] = { 0, n - 1, (n - 1) * n, (n - 1) * n + n - 1 };
+			float diffused[4];
+			std::vector<float>& scratch = tileScratch[0];
+			DiffuseDensityTile(path, a, { 0, 0, n, 2 }, scratch);
+			diffused[0] = scratch[0];
+			diffused[1] = scratch[n - 1];
+			DiffuseDensityTile(path, a, { 0, n - 2, n, n }, scratch);
+			diffused[2] = scratch[n];
+			diffused[3] = scratch[n + n - 1];
+
+			for (int corner : corners)
+				s[corner] = density[corner];
+			SetBnd(0, s);
+			density.swap(s);
+			for (int k = 0; k < 4; k++)
+				s[corners[k]] = diffused[k];
+		} }
+	});
+
+	diffusionPath[0] = path;
+	return true;
+}
+
+void Fluid::DiffuseDensityTile(DiffusionPath path, float a, const TileScheduler::Rect& cells, std::vector<float>& out) {
+	// Diffuse(0, s, density) restricted to a window, boundary cells included where the window reaches them. out
+	// holds the window's rows only, from its first one on.
+	const int n = size;
+	const int origin = cells.y0 * n;
+	int x0 = std::max(cells.x0, 1), x1 = std::min(cells.x1, n - 1);
+	int y0 = std::max(cells.y0, 1), y1 = std::min(cells.y1, n - 1);
+
+	Stencil::Field v(density, n);
+	for (int j = y0; j < y1; j++) {
+		if (path == DiffusionPath::COPY)
+			std::copy(density.begin() + j * n + x0, density.begin() + j * n + x1, out.begin() + (j * n + x0 - origin));
+		else
+			Stencil::Evaluate(j * n + x0, j * n + x1, Stencil::Assign(out, v + a * (v.At(1, 0) + v.At(-1, 0) + v.At(0, 1) + v.At(0, -1) - 4.0f * v), origin));
+	}
+
+	float* o = out.data();
+	auto at = [o, origin](int index) -> float& { return o[index - origin]; };
+	for (int j = y0; j < y1; j++) {
+		if (cells.x0 == 0) { at(j * n) = at(j * n + 1); }
+		if (cells.x1 == n) { at(j * n + n - 1) = at(j * n + n - 2); }
+	}
+	for (int i = x0; i < x1; i++) {
+		if (cells.y0 == 0) { at(i) = at(n + i); }
+		if (cells.y1 == n) { at((n - 1) * n + i) = at((n - 2) * n + i); }
+	}
+
+	// SetBnd averages a corner with its previous value: s's own for the explicit pass, density's after a copy
+	const std::vector<float>& previous = (path == DiffusionPath::COPY) ? density : s;
+	if (cells.x0 == 0 && cells.y0 == 0)
+		at(0) = 0.33f * (at(1) + at(n) + previous[0]);
+	if (cells.x1 == n && cells.y0 == 0)
+		at(n - 1) = 0.33f * (at(n - 2) + at(n + n - 1) + previous[n - 1]);
+	if (cells.x0 == 0 && cells.y1 == n)
+		at((n - 1) * n) = 0.33f * (at((n - 1) * n + 1) + at((n - 2) * n) + previous[(n - 1) * n]);
+	if (cells.x1 == n && cells.y1 == n)
+		at((n - 1) * n + n - 1) = 0.33f * (at((n - 1) * n + n - 2) + at((n - 2) * n + n - 1) + previous[(n - 1) * n + n - 1]);
 }
 
 void Fluid::ClearDivergence(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, std::vector<float>& div, int iter) {
-	for (int j = 1; j < size - 1; j++) {
-		for (int i = 1; i < size - 1; i++) {
-			div[IndexAt(i, j)] = -0.5f * (
-				vx[IndexAt(i + 1, j)]
-				- vx[IndexAt(i - 1, j)]
-				+ vy[IndexAt(i, j + 1)]
-				- vy[IndexAt(i, j - 1)]
-				) / size;
-			p[IndexAt(i, j)] = 0;
+	// Divergence and gradient run as tiles across the pool; the solve and the boundary passes need every interior
+	// cell, so they are the barriers between them
+	PrepareTiles();
+	std::fill(tileSpeed.begin(), tileSpeed.end(), 0.0f);
+
+	scheduler.Run(size, {
+		{ 0, [this, &vx, &vy, &p, &div](const TileScheduler::Rect& cells, int) {
+			DivergenceTile(vx, vy, p, div, cells);
+		} },
+		{ TileScheduler::GLOBAL, [this, &p, &div, iter](const TileScheduler::Rect&, int) {
+			SetBnd(0, div);
+			SetBnd(0, p);
+			if (projectionFactor > 1)
+				SolveCoarsePressure(p, div, iter);
+			else
+				SolvePressure(p, div, iter, size);
+		} },
+		{ 0, [this, &vx, &vy, &p](const TileScheduler::Rect& cells, int slot) {
+			SubtractGradientTile(vx, vy, p, cells, slot);
+		} },
+		{ TileScheduler::GLOBAL, [this, &vx, &vy](const TileScheduler::Rect&, int) {
+			SetBnd(1, vx);
+			SetBnd(2, vy);
+		} }
+	});
+}
+
+void Fluid::DivergenceTile(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, std::vector<float>& div, const TileScheduler::Rect& cells) {
+	Stencil::Field u(vx, size), v(vy, size);
+	for (int j = cells.y0; j < cells.y1; j++) {
+		Stencil::Evaluate(j * size + cells.x0, j * size + cells.x1,
+			Stencil::Assign(div, -0.5f * (u.At(1, 0) - u.At(-1, 0) + v.At(0, 1) - v.At(0, -1)) / size),
+			Stencil::Assign(p, Stencil::Constant(0.0f)));
+	}
+}
+
+void Fluid::SubtractGradientTile(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, const TileScheduler::Rect& cells, int slot) {
+	Stencil::Field q(p, size), u(vx, size), v(vy, size);
+	float speed = tileSpeed[slot];
+	for (int j = cells.y0; j < cells.y1; j++) {
+		int begin = j * size + cells.x0, end = j * size + cells.x1;
+		Stencil::Evaluate(begin, end,
+			Stencil::Assign(vx, u - 0.5f * (q.At(1, 0) - q.At(-1, 0)) * size),
+			Stencil::Assign(vy, v - 0.5f * (q.At(0, 1) - q.At(0, -1)) * size));
+
+		// The row is still in L1; this bounds the backtrace of the density step that follows
+		for (int index = begin; index < end; index++)
+			speed = std::max(speed, std::max(std::fabs(vx[index]), std::fabs(vy[index])));
+	}
+	tileSpeed[slot] = speed;
+}
+
+bool Fluid::SparseStep(float dt) {
+	// The collocated velocity-pressure step with linear semi-Lagrangian advection, solved by a backend that relaxes
+	// in place so it can be confined to the visited rows. Anything else steps the whole grid.
+	bool eligible = sparse && formulation == Formulation::VELOCITY_PRESSURE && !flip && !staggered
+		&& advectionScheme == AdvectionScheme::SEMI_LAGRANGIAN && interpolation == Interpolation::LINEAR
+		&& !SharesScratch(diffusionSolver) && !SharesScratch(pressureSolver) && projectionFactor <= 1 && !mixedPrecisionPressure;
+	if (!eligible) {
+		sparseSettled = false;
+		return false;
+	}
+
+	PrepareTiles();
+	if (!sparseSettled)
+		SettleSparseTiles();
+
+	// Past half the grid the dense passes, with their cache blocking and fused stages, are the faster way through.
+	// The tiles stay settled, and Step puts the visited ones back to sleep after the dense step.
+	int visited = VisitSparseTiles(dt);
+	if (2 * visited > sparseTiles * sparseTiles)
+		return false;
+	if (visited == 0)
+		return true;
+
+	TaskGraph graph;
+	graph.Add([this, dt] { diffusionPath[1] = DiffuseSparse(1, pVx, Vx, visc, dt, 16); });
+	graph.Add([this, dt] { diffusionPath[2] = DiffuseSparse(2, pVy, Vy, visc, dt, 16); });
+	graph.Run(pool);
+
+	ClearDivergenceSparse(pVx, pVy, Vx, Vy, pressureIterations);
+	AdvectTarget velocity[2] = { { 1, &Vx, &pVx }, { 2, &Vy, &pVy } };
+	AdvectSparse(velocity, 2, pVx, pVy, dt);
+	ClearDivergenceSparse(Vx, Vy, pVx, pVy, pressureIterations);
+
+	diffusionPath[0] = DiffuseSparse(0, s, density, diff, dt, 16);
+	AdvectTarget dye = { 0, &density, &s };
+	AdvectSparse(&dye, 1, Vx, Vy, dt);
+
+	SleepSparseTiles();
+	return true;
+}
+
+void Fluid::WakeTile(int index) {
+	if (tileAwake.empty())
+		return;
+	int x = index % size, y = index / size;
+	tileAwake[(y / sparseTileCells) * sparseTiles + x / sparseTileCells] = 1;
+}
+
+void Fluid::SettleSparseTiles() {
+	// After a dense step or a reset any tile may hold values: visit them all once and put the quiet ones to sleep
+	sparseRects.clear();
+	sparseBands.assign(sparseTiles + 1, 0);
+	for (int ty = 0; ty < sparseTiles; ty++) {
+		sparseRects.push_back({ 0, ty * sparseTileCells, size, std::min((ty + 1) * sparseTileCells, size) });
+		sparseBands[ty + 1] = ty + 1;
+	}
+
+	SleepSparseTiles();
+	sparseSettled = true;
+	redrawAll = true;
+}
+
+int Fluid::VisitSparseTiles(float dt) {
+	// Grow the awake tiles by the distance a backtrace can cover, plus sparseMargin cells for the diffusion and
+	// pressure solves, whose influence decays quickly with distance but has no hard edge
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+	float reach = std::ceil(std::fabs(dt0) * peakSpeed) + static_cast<float>(sparseMargin);
+	int grow = sparseTiles;
+	if (reach < static_cast<float>(sparseTiles * sparseTileCells))
+		grow = (static_cast<int>(reach) + sparseTileCells - 1) / sparseTileCells;
+
+	// Separable dilation: along the rows into tileVisited, then down the columns back into it
+	std::vector<unsigned char> across(tileAwake.size(), 0);
+	for (int ty = 0; ty < sparseTiles; ty++) {
+		for (int tx = 0; tx < sparseTiles; tx++) {
+			if (!tileAwake[ty * sparseTiles + tx])
+				continue;
+			int x0 = std::max(tx - grow, 0), x1 = std::min(tx + grow, sparseTiles - 1);
+			for (int x = x0; x <= x1; x++)
+				across[ty * sparseTiles + x] = 1;
+		}
+	}
+	std::fill(tileVisited.begin(), tileVisited.end(), 0);
+	int visited = 0;
+	for (int ty = 0; ty < sparseTiles; ty++) {
+		for (int tx = 0; tx < sparseTiles; tx++) {
+			if (!across[ty * sparseTiles + tx])
+				continue;
+			int y0 = std::max(ty - grow, 0), y1 = std::min(ty + grow, sparseTiles - 1);
+			for (int y = y0; y <= y1; y++) {
+				visited += 1 - tileVisited[y * sparseTiles + tx];
+				tileVisited[y * sparseTiles + tx] = 1;
+			}
 		}
 	}
 
+	sparseRects.clear();
+	sparseBands.assign(sparseTiles + 1, 0);
+	for (int ty = 0; ty < sparseTiles; ty++) {
+		for (int tx = 0; tx < sparseTiles;) {
+			if (!tileVisited[ty * sparseTiles + tx]) {
+				tx++;
+				continue;
+			}
+			int run = tx;
+			while (run < sparseTiles && tileVisited[ty * sparseTiles + run])
+				run++;
+			sparseRects.push_back({
+				tx * sparseTileCells, ty * sparseTileCells,
+				std::min(run * sparseTileCells, size), std::min((ty + 1) * sparseTileCells, size) });
+			tx = run;
+		}
+		sparseBands[ty + 1] = static_cast<int>(sparseRects.size());
+	}
+	return visited;
+}
+
+void Fluid::SleepSparseTiles() {
+	// Visited tiles whose dye and velocity fell within sparseEpsilon go back to exact zeros in all six fields, so
+	// the cells the next step skips read as still fluid. The awake ones bound the speed for the next step's reach.
+	std::fill(tileSpeed.begin(), tileSpeed.end(), 0.0f);
+	ForSparseRects([this](const TileScheduler::Rect& rect, int slot) {
+		for (int x0 = rect.x0; x0 < rect.x1; x0 += sparseTileCells) {
+			int x1 = std::min(x0 + sparseTileCells, rect.x1);
+			float peak = 0.0f, speed = 0.0f;
+			for (int j = rect.y0; j < rect.y1; j++) {
+				for (int index = j * size + x0; index < j * size + x1; index++) {
+					speed = std::max(speed, std::max(std::fabs(Vx[index]), std::fabs(Vy[index])));
+					peak = std::max(peak, std::fabs(density[index]));
+				}
+			}
+
+			bool awake = std::max(peak, speed) > sparseEpsilon;
+			tileAwake[(rect.y0 / sparseTileCells) * sparseTiles + x0 / sparseTileCells] = awake ? 1 : 0;
+			if (awake) {
+				tileSpeed[slot] = std::max(tileSpeed[slot], speed);
+				continue;
+			}
+
+			std::vector<float>* fields[6] = { &density, &s, &Vx, &Vy, &pVx, &pVy };
+			for (std::vector<float>* field : fields) {
+				for (int j = rect.y0; j < rect.y1; j++)
+					std::fill(field->begin() + j * size + x0, field->begin() + j * size + x1, 0.0f);
+			}
+		}
+	});
+
+	peakSpeed = 0.0f;
+	for (float speed : tileSpeed)
+		peakSpeed = std::max(peakSpeed, speed);
+}
+
+void Fluid::ForSparseRects(const std::function<void(const TileScheduler::Rect&, int)>& body) {
+	// Same slot scheme as TileScheduler: one chunk per slot, each pulling runs until none are left
+	std::atomic<int> next{ 0 };
+	int count = static_cast<int>(sparseRects.size());
+	pool.ParallelFor(0, scheduler.Slots(), 1, [this, &body, &next, count](int begin, int end) {
+		for (int slot = begin; slot < end; slot++) {
+			for (int k = next.fetch_add(1); k < count; k = next.fetch_add(1))
+				body(sparseRects[k], slot);
+		}
+	});
+}
+
+TileScheduler::Rect Fluid::SparseInterior(const TileScheduler::Rect& rect) const {
+	return { std::max(rect.x0, 1), std::max(rect.y0, 1), std::min(rect.x1, size - 1), std::min(rect.y1, size - 1) };
+}
+
+Fluid::DiffusionPath Fluid::DiffuseSparse(int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt, int iter) {
+	// Diffuse over the visited tiles; the boundary passes stay whole since they are only O(size)
+	float a = dt * diff * (size - 2) * (size - 2);
+	DiffusionPath path = ChooseDiffusionPath(a);
+
+	if (path == DiffusionPath::IMPLICIT) {
+		SolveSparse(diffusionSolver, b, x, x0, a, 1 + 6 * a, iter);
+		return path;
+	}
+
+	ForSparseRects([this, &x, &x0, a, path](const TileScheduler::Rect& rect, int) {
+		if (path == DiffusionPath::COPY) {
+			for (int j = rect.y0; j < rect.y1; j++)
+				std::copy(x0.begin() + j * size + rect.x0, x0.begin() + j * size + rect.x1, x.begin() + j * size + rect.x0);
+			return;
+		}
+
+		TileScheduler::Rect cells = SparseInterior(rect);
+		Stencil::Field v(x0, size);
+		for (int j = cells.y0; j < cells.y1; j++)
+			Stencil::Evaluate(j * size + cells.x0, j * size + cells.x1, Stencil::Assign(x, v + a * (v.At(1, 0) + v.At(-1, 0) + v.At(0, 1) + v.At(0, -1) - 4.0f * v)));
+	});
+	SetBnd(b, x);
+	return path;
+}
+
+void Fluid::SolveSparse(Solver solver, int b, std::vector<float>& x, std::vector<float>& x0, float a, float c, int iter) {
+	// Gauss-Seidel or red-black sweeps over the visited rows, each row's boundary cells refreshed as it is finished.
+	// Cells outside read as the zeros they sleep at, which holds the solution there.
+	float cRecip = 1.0f / c;
+	auto relax = [this, b, &x, &x0, a, cRecip](int j, int color) {
+		int ty = j / sparseTileCells;
+		if (sparseBands[ty] == sparseBands[ty + 1])
+			return;
+
+		float* row = &x[j * size];
+		const float* below = row - size;
+		const float* above = row + size;
+		const float* src = &x0[j * size];
+		for (int r = sparseBands[ty]; r < sparseBands[ty + 1]; r++) {
+			TileScheduler::Rect cells = SparseInterior(sparseRects[r]);
+			int first = cells.x0, step = 1;
+			if (color >= 0) {
+				first += (cells.x0 + j + color) & 1;
+				step = 2;
+			}
+			for (int i = first; i < cells.x1; i += step)
+				row[i] = (src[i] + a * (row[i + 1] + row[i - 1] + above[i] + below[i] + row[i] + row[i])) * cRecip;
+		}
+		SetRowBnd(b, x, j, size);
+	};
+
+	for (int k = 0; k < iter; k++) {
+		if (solver != Solver::RED_BLACK) {
+			for (int j = 1; j < size - 1; j++)
+				relax(j, -1);
+			continue;
+		}
+
+		// As in RedBlackSweep each half-sweep only reads the other colour, and a row's boundary cells are read by
+		// that row alone, so the rows of a colour run in parallel
+		for (int color = 0; color < 2; color++) {
+			pool.ParallelFor(1, size - 1, 16, [&relax, color](int begin, int end) {
+				for (int j = begin; j < end; j++)
+					relax(j, color);
+			});
+		}
+	}
+}
+
+void Fluid::ClearDivergenceSparse(std::vector<float>& vx, std::vector<float>& vy, std::vector<float>& p, std::vector<float>& div, int iter) {
+	ForSparseRects([this, &vx, &vy, &p, &div](const TileScheduler::Rect& rect, int) {
+		DivergenceTile(vx, vy, p, div, SparseInterior(rect));
+	});
 	SetBnd(0, div);
 	SetBnd(0, p);
-	LinSolve(0, p, div, 1, 6, iter);
 
+	SolveSparse(pressureSolver, 0, p, div, 1, 6, iter);
+
+	ForSparseRects([this, &vx, &vy, &p](const TileScheduler::Rect& rect, int slot) {
+		SubtractGradientTile(vx, vy, p, SparseInterior(rect), slot);
+	});
+	SetBnd(1, vx);
+	SetBnd(2, vy);
+}
+
+void Fluid::AdvectSparse(AdvectTarget* targets, int count, std::vector<float>& vx, std::vector<float>& vy, float dt) {
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+	ForSparseRects([this, targets, count, &vx, &vy, dt0](const TileScheduler::Rect& rect, int) {
+		TileScheduler::Rect cells = SparseInterior(rect);
+		for (int j = cells.y0; j < cells.y1; j++)
+			AdvectSharedRow(targets, count, vx, vy, dt0, j, cells.x0, cells.x1, 0);
+	});
+
+	for (int k = 0; k < count; k++)
+		SetBnd(targets[k].b, *targets[k].d);
+}
+
+void Fluid::SolvePressure(std::vector<float>& p, std::vector<float>& div, int iter, int n) {
+	if (mixedPrecisionPressure)
+		SolvePressureMixed(p, div, iter, n);
+	else
+		Solve(pressureSolver, 0, p, div, 1, 6, iter, n);
+}
+
+void Fluid::SolvePressureMixed(std::vector<float>& p, std::vector<float>& div, int iter, int n) {
+	int sweeps = iter / refinementCycles;
+	if (sweeps < 1) { sweeps = 1; }
+
+	for (int index = 0; index < n * n; index++)
+		pressureHi[index] = p[index];
+
+	for (int cycle = 0; cycle < refinementCycles; cycle++) {
+		for (int j = 1; j < n - 1; j++) {
+			for (int i = 1; i < n - 1; i++) {
+				double laplacian = 4.0 * pressureHi[IndexAt(i, j, n)]
+					- pressureHi[IndexAt(i + 1, j, n)]
+					- pressureHi[IndexAt(i - 1, j, n)]
+					- pressureHi[IndexAt(i, j + 1, n)]
+					- pressureHi[IndexAt(i, j - 1, n)];
+				pressureResidual[IndexAt(i, j, n)] = static_cast<float>(static_cast<double>(div[IndexAt(i, j, n)]) - laplacian);
+			}
+		}
+		SetBnd(0, pressureResidual, n);
+
+		std::fill(pressureCorrection.begin(), pressureCorrection.begin() + n * n, 0.0f);
+		Solve(pressureSolver, 0, pressureCorrection, pressureResidual, 1, 6, sweeps, n);
+
+		for (int index = 0; index < n * n; index++)
+			pressureHi[index] += pressureCorrection[index];
+	}
+
+	for (int index = 0; index < n * n; index++)
+		p[index] = static_cast<float>(pressureHi[index]);
+}
+
+void Fluid::SolveCoarsePressure(std::vector<float>& p, std::vector<float>& div, int iter) {
+	const int k = projectionFactor;
+	const int n = coarseSize;
+
+	// A coarse cell of width k*h sees k^2 times the fine right-hand side, so summing restricts and rescales at once
+	std::fill(coarseDiv.begin(), coarseDiv.end(), 0.0f);
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++)
+			coarseDiv[IndexAt(1 + (i - 1) / k, 1 + (j - 1) / k, n)] += div[IndexAt(i, j)];
+	}
+
+	std::fill(coarseP.begin(), coarseP.end(), 0.0f);
+	SetBnd(0, coarseDiv, n);
+	SolvePressure(coarseP, coarseDiv, iter, n);
+
+	// Bilinear prolongation: fine cell i sits at coarse coordinate (i + (k - 1) / 2) / k
+	float halfSpan = 0.5f * static_cast<float>(k - 1);
+	float kRecip = 1.0f / static_cast<float>(k);
 	for (int j = 1; j < size - 1; j++) {
+		float y = (static_cast<float>(j) + halfSpan) * kRecip;
+		int j0 = static_cast<int>(y);
+		float t1 = y - static_cast<float>(j0);
+		float t0 = 1.0f - t1;
 		for (int i = 1; i < size - 1; i++) {
-			vx[IndexAt(i, j)] -= 0.5f * (p[IndexAt(i + 1, j)] - p[IndexAt(i - 1, j)]) * size;
-			vy[IndexAt(i, j)] -= 0.5f * (p[IndexAt(i, j + 1)] - p[IndexAt(i, j - 1)]) * size;
+			float x = (static_cast<float>(i) + halfSpan) * kRecip;
+			int i0 = static_cast<int>(x);
+			float s1 = x - static_cast<float>(i0);
+			float s0 = 1.0f - s1;
+
+			p[IndexAt(i, j)] =
+				s0 * (t0 * coarseP[IndexAt(i0, j0, n)] + t1 * coarseP[IndexAt(i0, j0 + 1, n)]) +
+				s1 * (t0 * coarseP[IndexAt(i0 + 1, j0, n)] + t1 * coarseP[IndexAt(i0 + 1, j0 + 1, n)]);
 		}
 	}
-	SetBnd(1, vx);
-	SetBnd(2, vy);
+	SetBnd(0, p);
 }
 
 void Fluid::Advect(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt) {
-	float i0, i1, j0, j1;
+	if (interpolation == Interpolation::CUBIC) {
+		AdvectCubic(b, d, d0, vx, vy, dt);
+		return;
+	}
 
-	float dtx = dt * (static_cast<float>(size) - 2.0f);
-	float dty = dt * (static_cast<float>(size) - 2.0f);
+	AdvectTarget target = { b, &d, &d0 };
+	AdvectShared(&target, 1, vx, vy, dt);
+}
 
-	float s0, s1, t0, t1;
-	float tmp1, tmp2, x, y;
+int Fluid::BandRows(int fields) const {
+	// Rows of that many fields that fit the cache budget, capped to leave several bands per thread
+	int bandRows = wavefrontCacheBytes / (fields * size * static_cast<int>(sizeof(float)));
+	int balancedRows = (size - 2) / (4 * pool.ThreadCount());
+	if (bandRows > balancedRows) { bandRows = balancedRows; }
+	if (bandRows < 1) { bandRows = 1; }
+	return bandRows;
+}
 
-	float Nfloat = static_cast<float>(size);
-	float ifloat, jfloat;
+void Fluid::AdvectShared(AdvectTarget* targets, int count, std::vector<float>& vx, std::vector<float>& vy, float dt) {
+	// Every target moves with the same velocity, so each cell is backtraced once and its weights reused for all of them
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+
+	// Output rows only read the sources, so bands run in parallel. A band holds its velocity rows and the
+	// target rows it writes and gathers from.
+	int bandRows = BandRows(2 + 2 * count);
+
+	pool.ParallelFor(1, size - 1, bandRows, [this, targets, count, &vx, &vy, dt0](int begin, int end) {
+		for (int j = begin; j < end; j++)
+			AdvectSharedRow(targets, count, vx, vy, dt0, j, 1, size - 1, 0);
+	});
+
+	// The boundary copies read interior cells other bands wrote, so they wait for ParallelFor to join
+	for (int k = 0; k < count; k++)
+		SetBnd(targets[k].b, *targets[k].d);
+}
+
+void Fluid::AdvectSharedRow(AdvectTarget* targets, int count, std::vector<float>& vx, std::vector<float>& vy, float dt0, int j, int begin, int end, int origin) {
+	// The backtrace is clamped to [0.5, size + 0.5] before the floor, so truncation is the floor, and
+	// clamping the corner coordinates to size - 1 replaces IndexAt. Corner indices are built in float,
+	// which is exact below 2^24 cells and avoids a 32-bit integer multiply SSE2 does not have. Sources may hold
+	// only part of the grid, starting at cell index origin.
+	const int row = j * size;
+	const float Nfloat = static_cast<float>(size);
+	const float jfloat = static_cast<float>(j);
+	const float originFloat = static_cast<float>(origin);
+	int i = begin;
+
+#if defined(__AVX2__)
+	const __m256 lo8 = _mm256_set1_ps(0.5f);
+	const __m256 hi8 = _mm256_set1_ps(Nfloat + 0.5f);
+	const __m256 last8 = _mm256_set1_ps(Nfloat - 1.0f);
+	const __m256 one8 = _mm256_set1_ps(1.0f);
+	const __m256 n8 = _mm256_set1_ps(Nfloat);
+	const __m256 origin8 = _mm256_set1_ps(originFloat);
+	const __m256 dt8 = _mm256_set1_ps(dt0);
+	const __m256 lane8 = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+	for (; i + 8 <= end; i += 8) {
+		__m256 x = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps(static_cast<float>(i)), lane8), _mm256_mul_ps(dt8, _mm256_loadu_ps(&vx[row + i])));
+		__m256 y = _mm256_sub_ps(_mm256_set1_ps(jfloat), _mm256_mul_ps(dt8, _mm256_loadu_ps(&vy[row + i])));
+		x = _mm256_min_ps(_mm256_max_ps(x, lo8), hi8);
+		y = _mm256_min_ps(_mm256_max_ps(y, lo8), hi8);
+
+		__m256 x0 = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(x));
+		__m256 y0 = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(y));
+		__m256 s1 = _mm256_sub_ps(x, x0), s0 = _mm256_sub_ps(one8, s1);
+		__m256 t1 = _mm256_sub_ps(y, y0), t0 = _mm256_sub_ps(one8, t1);
+
+		__m256 col0 = _mm256_min_ps(x0, last8);
+		__m256 col1 = _mm256_min_ps(_mm256_add_ps(x0, one8), last8);
+		__m256 row0 = _mm256_sub_ps(_mm256_mul_ps(_mm256_min_ps(y0, last8), n8), origin8);
+		__m256 row1 = _mm256_sub_ps(_mm256_mul_ps(_mm256_min_ps(_mm256_add_ps(y0, one8), last8), n8), origin8);
+		__m256i index00 = _mm256_cvttps_epi32(_mm256_add_ps(row0, col0));
+		__m256i index01 = _mm256_cvttps_epi32(_mm256_add_ps(row1, col0));
+		__m256i index10 = _mm256_cvttps_epi32(_mm256_add_ps(row0, col1));
+		__m256i index11 = _mm256_cvttps_epi32(_mm256_add_ps(row1, col1));
+
+		for (int k = 0; k < count; k++) {
+			const float* d0 = targets[k].d0->data();
+			__m256 left = _mm256_add_ps(_mm256_mul_ps(t0, _mm256_i32gather_ps(d0, index00, 4)), _mm256_mul_ps(t1, _mm256_i32gather_ps(d0, index01, 4)));
+			__m256 right = _mm256_add_ps(_mm256_mul_ps(t0, _mm256_i32gather_ps(d0, index10, 4)), _mm256_mul_ps(t1, _mm256_i32gather_ps(d0, index11, 4)));
+			_mm256_storeu_ps(&(*targets[k].d)[row + i], _mm256_add_ps(_mm256_mul_ps(s0, left), _mm256_mul_ps(s1, right)));
+		}
+	}
+#elif defined(FLUID_SSE2)
+	const __m128 lo4 = _mm_set1_ps(0.5f);
+	const __m128 hi4 = _mm_set1_ps(Nfloat + 0.5f);
+	const __m128 last4 = _mm_set1_ps(Nfloat - 1.0f);
+	const __m128 one4 = _mm_set1_ps(1.0f);
+	const __m128 n4 = _mm_set1_ps(Nfloat);
+	const __m128 origin4 = _mm_set1_ps(originFloat);
+	const __m128 dt4 = _mm_set1_ps(dt0);
+	const __m128 lane4 = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+
+	for (; i + 4 <= end; i += 4) {
+		__m128 x = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(static_cast<float>(i)), lane4), _mm_mul_ps(dt4, _mm_loadu_ps(&vx[row + i])));
+		__m128 y = _mm_sub_ps(_mm_set1_ps(jfloat), _mm_mul_ps(dt4, _mm_loadu_ps(&vy[row + i])));
+		x = _mm_min_ps(_mm_max_ps(x, lo4), hi4);
+		y = _mm_min_ps(_mm_max_ps(y, lo4), hi4);
+
+		__m128 x0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+		__m128 y0 = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+		__m128 s1 = _mm_sub_ps(x, x0), s0 = _mm_sub_ps(one4, s1);
+		__m128 t1 = _mm_sub_ps(y, y0), t0 = _mm_sub_ps(one4, t1);
+
+		__m128 col0 = _mm_min_ps(x0, last4);
+		__m128 col1 = _mm_min_ps(_mm_add_ps(x0, one4), last4);
+		__m128 row0 = _mm_sub_ps(_mm_mul_ps(_mm_min_ps(y0, last4), n4), origin4);
+		__m128 row1 = _mm_sub_ps(_mm_mul_ps(_mm_min_ps(_mm_add_ps(y0, one4), last4), n4), origin4);
 
-	int i, j;
+		// No gather before AVX2: spill the corner indices and load the samples one by one
+		alignas(16) int index[4][4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(index[0]), _mm_cvttps_epi32(_mm_add_ps(row0, col0)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(index[1]), _mm_cvttps_epi32(_mm_add_ps(row1, col0)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(index[2]), _mm_cvttps_epi32(_mm_add_ps(row0, col1)));
+		_mm_store_si128(reinterpret_cast<__m128i*>(index[3]), _mm_cvttps_epi32(_mm_add_ps(row1, col1)));
 
-	for (j = 1, jfloat = 1; j < size - 1; j++, jfloat++) {
-		for (i = 1, ifloat = 1; i < size - 1; i++, ifloat++) {
-			tmp1 = dtx * vx[IndexAt(i, j)];
-			tmp2 = dty * vy[IndexAt(i, j)];
-			x = ifloat - tmp1;
-			y = jfloat - tmp2;
+		for (int k = 0; k < count; k++) {
+			const float* d0 = targets[k].d0->data();
+			__m128 c[4];
+			for (int n = 0; n < 4; n++)
+				c[n] = _mm_setr_ps(d0[index[n][0]], d0[index[n][1]], d0[index[n][2]], d0[index[n][3]]);
+			__m128 left = _mm_add_ps(_mm_mul_ps(t0, c[0]), _mm_mul_ps(t1, c[1]));
+			__m128 right = _mm_add_ps(_mm_mul_ps(t0, c[2]), _mm_mul_ps(t1, c[3]));
+			_mm_storeu_ps(&(*targets[k].d)[row + i], _mm_add_ps(_mm_mul_ps(s0, left), _mm_mul_ps(s1, right)));
+		}
+	}
+#endif
+
+	for (; i < end; i++) {
+		float x = static_cast<float>(i) - dt0 * vx[row + i];
+		float y = jfloat - dt0 * vy[row + i];
+		x = x < 0.5f ? 0.5f : (x > Nfloat + 0.5f ? Nfloat + 0.5f : x);
+		y = y < 0.5f ? 0.5f : (y > Nfloat + 0.5f ? Nfloat + 0.5f : y);
+
+		int i0 = static_cast<int>(x);
+		int j0 = static_cast<int>(y);
+		float s1 = x - static_cast<float>(i0), s0 = 1.0f - s1;
+		float t1 = y - static_cast<float>(j0), t0 = 1.0f - t1;
+
+		int index00 = IndexAt(i0, j0) - origin, index01 = IndexAt(i0, j0 + 1) - origin;
+		int index10 = IndexAt(i0 + 1, j0) - origin, index11 = IndexAt(i0 + 1, j0 + 1) - origin;
+
+		for (int k = 0; k < count; k++) {
+			const std::vector<float>& d0 = *targets[k].d0;
+			(*targets[k].d)[row + i] =
+				s0 * (t0 * d0[index00] + t1 * d0[index01]) +
+				s1 * (t0 * d0[index10] + t1 * d0[index11]);
+		}
+	}
+}
+
+void Fluid::AdvectCubic(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt) {
+	const int pad = 2;
+	const int stride = size + 2 * pad;
+
+	for (int j = -pad; j < size + pad; j++) {
+		const float* src = &d0[IndexAt(0, j)];
+		float* dst = &advectPadded[(j + pad) * stride + pad];
+		for (int i = -pad; i < 0; i++)
+			dst[i] = src[0];
+		std::copy(src, src + size, dst);
+		for (int i = size; i < size + pad; i++)
+			dst[i] = src[size - 1];
+	}
+
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+	float hi = static_cast<float>(size) - 1.0f;
+
+	pool.ParallelFor(1, size - 1, 8, [this, &d, &vx, &vy, dt0, hi, pad, stride](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			for (int i = 1; i < size - 1; i++) {
+				float x = static_cast<float>(i) - dt0 * vx[IndexAt(i, j)];
+				float y = static_cast<float>(j) - dt0 * vy[IndexAt(i, j)];
+				x = x < 0.0f ? 0.0f : (x > hi ? hi : x);
+				y = y < 0.0f ? 0.0f : (y > hi ? hi : y);
 
+				int i0 = static_cast<int>(x);
+				int j0 = static_cast<int>(y);
+				const float* p = &advectPadded[(j0 - 1 + pad) * stride + (i0 - 1 + pad)];
+				d[IndexAt(i, j)] = SampleCubic(p, stride, x - static_cast<float>(i0), y - static_cast<float>(j0));
+			}
+		}
+	});
+	SetBnd(b, d);
+}
+
+float Fluid::SampleCubic(const float* p, int stride, float fx, float fy) {
+	// Catmull-Rom along y for each of the four columns, then along x. Each pass is clamped to its two
+	// middle samples, which keeps the result monotone and inside the bilinear cell.
+	float fy2 = fy * fy, fy3 = fy2 * fy;
+	float fx2 = fx * fx, fx3 = fx2 * fx;
+	float wy0 = -0.5f * fy3 + fy2 - 0.5f * fy;
+	float wy1 = 1.5f * fy3 - 2.5f * fy2 + 1.0f;
+	float wy2 = -1.5f * fy3 + 2.0f * fy2 + 0.5f * fy;
+	float wy3 = 0.5f * fy3 - 0.5f * fy2;
+	float wx0 = -0.5f * fx3 + fx2 - 0.5f * fx;
+	float wx1 = 1.5f * fx3 - 2.5f * fx2 + 1.0f;
+	float wx2 = -1.5f * fx3 + 2.0f * fx2 + 0.5f * fx;
+	float wx3 = 0.5f * fx3 - 0.5f * fx2;
+
+#ifdef FLUID_SSE2
+	__m128 r0 = _mm_loadu_ps(p);
+	__m128 r1 = _mm_loadu_ps(p + stride);
+	__m128 r2 = _mm_loadu_ps(p + 2 * stride);
+	__m128 r3 = _mm_loadu_ps(p + 3 * stride);
+
+	__m128 column = _mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(wy0)), _mm_mul_ps(r1, _mm_set1_ps(wy1))),
+		_mm_add_ps(_mm_mul_ps(r2, _mm_set1_ps(wy2)), _mm_mul_ps(r3, _mm_set1_ps(wy3))));
+	column = _mm_max_ps(_mm_min_ps(column, _mm_max_ps(r1, r2)), _mm_min_ps(r1, r2));
+
+	__m128 product = _mm_mul_ps(column, _mm_setr_ps(wx0, wx1, wx2, wx3));
+	__m128 swapped = _mm_shuffle_ps(product, product, _MM_SHUFFLE(2, 3, 0, 1));
+	__m128 sums = _mm_add_ps(product, swapped);
+	__m128 value = _mm_add_ss(sums, _mm_movehl_ps(swapped, sums));
+
+	__m128 c1 = _mm_shuffle_ps(column, column, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 c2 = _mm_shuffle_ps(column, column, _MM_SHUFFLE(2, 2, 2, 2));
+	value = _mm_max_ss(_mm_min_ss(value, _mm_max_ss(c1, c2)), _mm_min_ss(c1, c2));
+	return _mm_cvtss_f32(value);
+#else
+	float column[4];
+	for (int i = 0; i < 4; i++) {
+		float a = p[i], b = p[stride + i], c = p[2 * stride + i], e = p[3 * stride + i];
+		float v = wy0 * a + wy1 * b + wy2 * c + wy3 * e;
+		column[i] = std::max(std::min(v, std::max(b, c)), std::min(b, c));
+	}
+	float value = wx0 * column[0] + wx1 * column[1] + wx2 * column[2] + wx3 * column[3];
+	return std::max(std::min(value, std::max(column[1], column[2])), std::min(column[1], column[2]));
+#endif
+}
+
+void Fluid::AdvectField(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt) {
+	switch (advectionScheme) {
+	case AdvectionScheme::MACCORMACK:
+		// Forward step, then undo it and correct by half the round-trip error
+		Advect(b, d, d0, vx, vy, dt);
+		Advect(b, advectBackward, d, vx, vy, -dt);
+		for (int index = 0; index < size * size; index++)
+			d[index] += 0.5f * (d0[index] - advectBackward[index]);
+		LimitToSource(b, d, d0, vx, vy, dt);
+		break;
+
+	case AdvectionScheme::BFECC:
+		// Compensate the source by half the round-trip error, then take the forward step from it
+		Advect(b, advectForward, d0, vx, vy, dt);
+		Advect(b, advectBackward, advectForward, vx, vy, -dt);
+		for (int index = 0; index < size * size; index++)
+			advectForward[index] = d0[index] + 0.5f * (d0[index] - advectBackward[index]);
+		Advect(b, d, advectForward, vx, vy, dt);
+		LimitToSource(b, d, d0, vx, vy, dt);
+		break;
+
+	default:
+		Advect(b, d, d0, vx, vy, dt);
+		break;
+	}
+}
+
+void Fluid::LimitToSource(int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& vx, std::vector<float>& vy, float dt) {
+	// Clamp to the four source cells the plain backtrace interpolates, which keeps the corrected step free of new extrema
+	float dt0 = dt * (static_cast<float>(size) - 2.0f);
+	float Nfloat = static_cast<float>(size);
+
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++) {
+			float x = static_cast<float>(i) - dt0 * vx[IndexAt(i, j)];
+			float y = static_cast<float>(j) - dt0 * vy[IndexAt(i, j)];
 			if (x < 0.5f) x = 0.5f;
 			if (x > Nfloat + 0.5f) x = Nfloat + 0.5f;
-			i0 = ::floorf(x);
-			i1 = i0 + 1.0f;
 			if (y < 0.5f) y = 0.5f;
 			if (y > Nfloat + 0.5f) y = Nfloat + 0.5f;
-			j0 = ::floorf(y);
-			j1 = j0 + 1.0f;
 
-			s1 = x - i0;
-			s0 = 1.0f - s1;
-			t1 = y - j0;
-			t0 = 1.0f - t1;
+			int i0 = static_cast<int>(::floorf(x));
+			int j0 = static_cast<int>(::floorf(y));
 
-			int i0i = static_cast<int>(i0);
-			int i1i = static_cast<int>(i1);
-			int j0i = static_cast<int>(j0);
-			int j1i = static_cast<int>(j1);
+			float a = d0[IndexAt(i0, j0)];
+			float c = d0[IndexAt(i0 + 1, j0)];
+			float e = d0[IndexAt(i0, j0 + 1)];
+			float g = d0[IndexAt(i0 + 1, j0 + 1)];
+			float lo = std::min(std::min(a, c), std::min(e, g));
+			float hi = std::max(std::max(a, c), std::max(e, g));
 
-			d[IndexAt(i, j)] =
-				s0 * (t0 * d0[IndexAt(i0i, j0i)] + t1 * d0[IndexAt(i0i, j1i)]) +
-				s1 * (t0 * d0[IndexAt(i1i, j0i)] + t1 * d0[IndexAt(i1i, j1i)]);
+			float& value = d[IndexAt(i, j)];
+			if (value < lo) value = lo;
+			if (value > hi) value = hi;
 		}
 	}
 	SetBnd(b, d);
 }
 
-void Fluid::PrintDensity() {
-	for (int i = 0; i < size; ++i) {
-		for (int j = 0; j < size; ++j)
-			std::cout << density[IndexAt(i, j)] << "\t";
-		std::cout << "\n";
+Fluid::DiffusionPath Fluid::GetDiffusionPath(int b) const {
+	return diffusionPath[b];
+}
+
+void Fluid::SetProjectionCoarsening(int factor) {
+	if (factor < 1) { factor = 1; }
+	if (factor > size - 2) { factor = size - 2; }
+
+	projectionFactor = factor;
+	coarseSize = (size - 2 + factor - 1) / factor + 2;
+	coarseP = std::vector<float>(factor > 1 ? coarseSize * coarseSize : 0);
+	coarseDiv = std::vector<float>(factor > 1 ? coarseSize * coarseSize : 0);
+}
+
+void Fluid::SetMixedPrecisionPressure(bool enabled, int cycles) {
+	mixedPrecisionPressure = enabled;
+	refinementCycles = cycles < 1 ? 1 : cycles;
+	pressureHi = std::vector<double>(enabled ? size * size : 0);
+	pressureResidual = std::vector<float>(enabled ? size * size : 0);
+	pressureCorrection = std::vector<float>(enabled ? size * size : 0);
+}
+
+void Fluid::SetFlip(bool enabled, float ratio) {
+	flip = enabled;
+	flipRatio = ratio;
+	flipU = std::vector<float>(Vx);
+	flipV = std::vector<float>(Vy);
+	cellStart = std::vector<int>(enabled ? size * size + 1 : 0);
+	cellCursor = std::vector<int>(enabled ? size * size : 0);
+
+	if (enabled) {
+		SeedParticles();
+	} else {
+		particlePos.clear();
+		particleVel.clear();
+	}
+	sortedPos = std::vector<glm::vec2>(particlePos.size());
+	sortedVel = std::vector<glm::vec2>(particlePos.size());
+	particleCell = std::vector<int>(particlePos.size());
+}
+
+void Fluid::SetStaggered(bool enabled) {
+	// The two layouts interpret Vx/Vy differently, so switching starts from rest
+	staggered = enabled;
+	std::fill(Vx.begin(), Vx.end(), 0.0f);
+	std::fill(Vy.begin(), Vy.end(), 0.0f);
+}
+
+void Fluid::SetAdvectionScheme(AdvectionScheme scheme) {
+	advectionScheme = scheme;
+	advectForward = std::vector<float>(scheme == AdvectionScheme::BFECC ? size * size : 0);
+	advectBackward = std::vector<float>(scheme != AdvectionScheme::SEMI_LAGRANGIAN ? size * size : 0);
+}
+
+void Fluid::SetInterpolation(Interpolation value) {
+	interpolation = value;
+	advectPadded = std::vector<float>(value == Interpolation::CUBIC ? (size + 4) * (size + 4) : 0);
+}
+
+void Fluid::SetDiffusionSolver(Solver solver) {
+	diffusionSolver = solver;
+	ReserveSolverScratch();
+}
+
+void Fluid::SetPressureSolver(Solver solver) {
+	pressureSolver = solver;
+	ReserveSolverScratch();
+}
+
+void Fluid::ReserveSolverScratch() {
+	bool krylov = (diffusionSolver == Solver::CONJUGATE_GRADIENT || pressureSolver == Solver::CONJUGATE_GRADIENT);
+	bool scratch = krylov || diffusionSolver == Solver::JACOBI || pressureSolver == Solver::JACOBI;
+	solverScratch = std::vector<float>(scratch ? size * size : 0);
+	solverDirection = std::vector<float>(krylov ? size * size : 0);
+	solverProduct = std::vector<float>(krylov ? size * size : 0);
+}
+
+void Fluid::SetFormulation(Formulation value) {
+	formulation = value;
+	psi = std::vector<float>(value == Formulation::VORTICITY_STREAMFUNCTION ? size * size : 0);
+}
+
+void Fluid::SetSparseTiles(bool enabled, float epsilon) {
+	sparse = enabled;
+	sparseEpsilon = epsilon;
+	sparseSettled = false;
+	sparseTiles = (size + sparseTileCells - 1) / sparseTileCells;
+	tileAwake.assign(enabled ? sparseTiles * sparseTiles : 0, 0);
+	tileVisited.assign(tileAwake.size(), 0);
+}
+
+void Fluid::SetCflLimit(float limit, int substeps) {
+	// A limit of 0 steps every frame whole; maxFrameTime still applies
+	cflLimit = limit;
+	maxSubsteps = (substeps < 1) ? 1 : substeps;
+}
+
+void Fluid::SetMaxFrameTime(float seconds) {
+	maxFrameTime = seconds;
+}
+
+void Fluid::AutoTune(const std::string& cachePath, int repeats) {
+	// One tab-separated line per CPU model and grid size: solver, cache bytes, threads, iterations
+	const std::string model = CpuModel();
+	{
+		std::ifstream cache(cachePath);
+		std::string line;
+		while (std::getline(cache, line)) {
+			std::istringstream fields(line);
+			std::string cpu;
+			int grid, solver;
+			TuningConfig config;
+			if (std::getline(fields, cpu, '\t') && fields >> grid >> solver >> config.cacheBytes >> config.threads >> config.iterations
+				&& cpu == model && grid == size) {
+				config.solver = static_cast<Solver>(solver);
+				ApplyTuning(config);
+				return;
+			}
+		}
+	}
+
+	// A fixed zero-mean divergence stands in for the projection; the default 16 Gauss-Seidel sweeps set the residual to meet
+	std::vector<float> div(size * size), p(size * size), product(size * size);
+	unsigned int seed = 1;
+	double mean = 0.0;
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++) {
+			seed = seed * 1664525u + 1013904223u;
+			div[IndexAt(i, j)] = static_cast<float>(seed >> 8) / 16777216.0f - 0.5f;
+			mean += div[IndexAt(i, j)];
+		}
 	}
-	std::cout << "\n";
+	mean /= static_cast<double>(size - 2) * (size - 2);
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++)
+			div[IndexAt(i, j)] -= static_cast<float>(mean);
+	}
+
+	const int hardware = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	TuningConfig best = { Solver::GAUSS_SEIDEL, 512 * 1024, hardware, 16 };
+	ApplyTuning(best);
+	std::fill(p.begin(), p.end(), 0.0f);
+	Solve(pressureSolver, 0, p, div, 1, 6, pressureIterations, size);
+	double target = PressureResidual(p, div, product) * 1.0001;
+	double bestTime = TimePressureSolve(p, div, repeats);
+
+	const Solver solvers[] = { Solver::GAUSS_SEIDEL, Solver::RED_BLACK, Solver::JACOBI, Solver::MULTIGRID, Solver::CONJUGATE_GRADIENT };
+	const int iterationCounts[] = { 2, 4, 8, 12, 16, 24, 32 };
+	const int cacheSizes[] = { 128 * 1024, 512 * 1024, 2048 * 1024 };
+	const int threadCounts[] = { hardware, (hardware + 1) / 2, 1 };
+
+	for (Solver solver : solvers) {
+		// Residuals do not depend on the thread count or the band size, so find the fewest iterations first
+		TuningConfig config = { solver, 512 * 1024, hardware, 0 };
+		for (int iterations : iterationCounts) {
+			config.iterations = iterations;
+			ApplyTuning(config);
+			std::fill(p.begin(), p.end(), 0.0f);
+			Solve(pressureSolver, 0, p, div, 1, 6, pressureIterations, size);
+			if (PressureResidual(p, div, product) <= target)
+				break;
+			config.iterations = 0;
+		}
+		if (config.iterations == 0)
+			continue;
+
+		// The thread count also drives advection and every other pass, so it is only traded away where the solve itself
+		// runs on the pool; Gauss-Seidel is serial and keeps every thread. Fewer threads must win outright, not tie.
+		for (int threads : threadCounts) {
+			if (solver == Solver::GAUSS_SEIDEL && threads != hardware)
+				continue;
+
+			for (int cacheBytes : cacheSizes) {
+				// The band size only steers the wavefront Gauss-Seidel
+				if (solver != Solver::GAUSS_SEIDEL && cacheBytes != 512 * 1024)
+					continue;
+
+				config.threads = threads;
+				config.cacheBytes = cacheBytes;
+				ApplyTuning(config);
+				double time = TimePressureSolve(p, div, repeats);
+				if (time < bestTime) {
+					bestTime = time;
+					best = config;
+				}
+			}
+		}
+	}
+
+	ApplyTuning(best);
+	std::ofstream cache(cachePath, std::ios::app);
+	cache << model << '\t' << size << '\t' << static_cast<int>(best.solver) << '\t' << best.cacheBytes
+		<< '\t' << best.threads << '\t' << best.iterations << '\n';
+}
+
+void Fluid::ApplyTuning(const TuningConfig& config) {
+	SetPressureSolver(config.solver);
+	wavefrontCacheBytes = config.cacheBytes;
+	pool.SetThreadCount(config.threads);
+	pressureIterations = config.iterations;
+}
+
+double Fluid::TimePressureSolve(std::vector<float>& p, std::vector<float>& div, int repeats) {
+	// Best of several runs, so a one-off allocation or page fault does not decide the pick
+	double best = 0.0;
+	for (int k = 0; k < repeats || k == 0; k++) {
+		auto start = std::chrono::steady_clock::now();
+		std::fill(p.begin(), p.end(), 0.0f);
+		Solve(pressureSolver, 0, p, div, 1, 6, pressureIterations, size);
+		double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (k == 0 || time < best)
+			best = time;
+	}
+	return best;
+}
+
+double Fluid::PressureResidual(std::vector<float>& p, std::vector<float>& div, std::vector<float>& product) {
+	SetBnd(0, p);
+	ApplyOperator(product, p, 1, 6, size);
+
+	double residual = 0.0, norm = 0.0;
+	for (int j = 1; j < size - 1; j++) {
+		for (int i = 1; i < size - 1; i++) {
+			double error = static_cast<double>(div[IndexAt(i, j)]) - product[IndexAt(i, j)];
+			residual += error * error;
+			norm += static_cast<double>(div[IndexAt(i, j)]) * div[IndexAt(i, j)];
+		}
+	}
+	return norm > 0.0 ? std::sqrt(residual / norm) : 0.0;
+}
+
+std::string Fluid::CpuModel() {
+	// The processor brand string from CPUID leaves 0x80000002-4, or "unknown" where there is none
+	unsigned int brand[12] = {};
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if (static_cast<unsigned int>(regs[0]) >= 0x80000004u) {
+		for (int k = 0; k < 3; k++)
+			__cpuid(reinterpret_cast<int*>(&brand[4 * k]), 0x80000002 + k);
+	}
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	if (__get_cpuid_max(0x80000000u, nullptr) >= 0x80000004u) {
+		for (unsigned int k = 0; k < 3; k++)
+			__get_cpuid(0x80000002u + k, &brand[4 * k], &brand[4 * k + 1], &brand[4 * k + 2], &brand[4 * k + 3]);
+	}
+#endif
+
+	std::string model(reinterpret_cast<const char*>(brand), sizeof(brand));
+	model = model.c_str();
+	std::replace(model.begin(), model.end(), '\t', ' ');
+	size_t first = model.find_first_not_of(' ');
+	size_t last = model.find_last_not_of(' ');
+	return (first == std::string::npos) ? "unknown" : model.substr(first, last - first + 1);
 }
 
 #endif
@@ -0,0 +1,355 @@
+#pragma once
+#ifndef LATTICE_BOLTZMANN_H
+#define LATTICE_BOLTZMANN_H
+
+#include "Simulation.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LATTICE_BOLTZMANN_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// D2Q9 BGK lattice Boltzmann engine. Distributions are stored as nine size x size planes (SoA) and
+// advanced with a fused pull stream-collide; the outer ring of cells is a bounce-back wall.
+class LatticeBoltzmann : public Simulation {
+private:
+	static constexpr int Q = 9;
+	static constexpr int ex[Q] = { 0, 1, 0, -1, 0, 1, -1, -1, 1 };
+	static constexpr int ey[Q] = { 0, 0, 1, 0, -1, 1, 1, -1, -1 };
+	static constexpr int opposite[Q] = { 0, 3, 4, 1, 2, 7, 8, 5, 6 };
+	static constexpr float weight[Q] = {
+		4.0f / 9.0f,
+		1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f, 1.0f / 9.0f,
+		1.0f / 36.0f, 1.0f / 36.0f, 1.0f / 36.0f, 1.0f / 36.0f
+	};
+
+	const int cells;
+
+	// Physical seconds per lattice step, and the cap that keeps a hitch from stalling the frame
+	float latticeDt = 1.0f / 240.0f;
+	int maxStepsPerFrame = 8;
+	float pendingTime = 0.0f;
+
+	// Lattice speeds must stay well below the speed of sound (1 / sqrt(3)) for the BGK model to hold
+	float maxLatticeSpeed = 0.2f;
+	float omega;
+
+	std::vector<float> f;
+	std::vector<float> fNext;
+
+	std::vector<float> rho;
+	std::vector<float> ux;
+	std::vector<float> uy;
+
+	std::vector<float> s;
+
+	ThreadPool pool;
+
+private:
+	void Reset();
+	void Step();
+	void StreamCollideRow(int j);
+	void BounceBackCell(int i, int j);
+	void AdvectDye(float steps);
+
+	static float Equilibrium(int q, float r, float u, float v);
+
+public:
+	LatticeBoltzmann(const int& grid_size, const float& diffusion, const float& viscocity);
+
+	void AddDensity(int x, int y, float amount) override;
+	void AddVelocity(int x, int y, glm::vec2 amount) override;
+
+	void Update(const float& dt) override;
+
+	void Clean() override;
+};
+
+LatticeBoltzmann::LatticeBoltzmann(const int& grid_size, const float& /* diffusion */, const float& viscocity)
+	: Simulation(grid_size), cells(grid_size * grid_size) {
+
+	// Same scaling as Fluid::Diffuse: viscocity * (size - 2)^2 is the kinematic viscosity in cells^2 per second.
+	// Dye diffusion at these rates is far below what the dye interpolation smears, so diffusion goes unused.
+	float nu = viscocity * (size - 2) * (size - 2) * latticeDt;
+	float tau = 3.0f * nu + 0.5f;
+	if (tau < 0.505f) { tau = 0.505f; }
+	omega = 1.0f / tau;
+
+	f = std::vector<float>(Q * cells);
+	fNext = std::vector<float>(Q * cells);
+	rho = std::vector<float>(cells);
+	ux = std::vector<float>(cells);
+	uy = std::vector<float>(cells);
+	s = std::vector<float>(cells);
+
+	Reset();
+}
+
+float LatticeBoltzmann::Equilibrium(int q, float r, float u, float v) {
+	float eu = 3.0f * (ex[q] * u + ey[q] * v);
+	return weight[q] * r * (1.0f + eu + 0.5f * eu * eu - 1.5f * (u * u + v * v));
+}
+
+void LatticeBoltzmann::Reset() {
+	for (int q = 0; q < Q; q++) {
+		std::fill(f.begin() + q * cells, f.begin() + (q + 1) * cells, weight[q]);
+		std::fill(fNext.begin() + q * cells, fNext.begin() + (q + 1) * cells, weight[q]);
+	}
+	std::fill(rho.begin(), rho.end(), 1.0f);
+	std::fill(ux.begin(), ux.end(), 0.0f);
+	std::fill(uy.begin(), uy.end(), 0.0f);
+	pendingTime = 0.0f;
+}
+
+void LatticeBoltzmann::AddDensity(int x, int y, float amount) {
+	if (x < 0 || x > size - 1 || y < 0 || y > size - 1)
+		return;
+	density[(y * size) + x] += amount;
+}
+
+void LatticeBoltzmann::AddVelocity(int x, int y, glm::vec2 amount) {
+	if (x < 1 || x > size - 2 || y < 1 || y > size - 2)
+		return;
+
+	int index = (y * size) + x;
+	float u = ux[index] + amount.x * (size - 2) * latticeDt;
+	float v = uy[index] + amount.y * (size - 2) * latticeDt;
+
+	float speed = std::sqrt(u * u + v * v);
+	if (speed > maxLatticeSpeed) {
+		u *= maxLatticeSpeed / speed;
+		v *= maxLatticeSpeed / speed;
+	}
+
+	// Shift the cell to the new velocity while keeping its non-equilibrium part
+	float r = rho[index];
+	for (int q = 0; q < Q; q++)
+		f[q * cells + index] += Equilibrium(q, r, u, v) - Equilibrium(q, r, ux[index], uy[index]);
+	ux[index] = u;
+	uy[index] = v;
+}
+
+void LatticeBoltzmann::Update(const float& dt) {
+	pendingTime += dt;
+	int steps = static_cast<int>(pendingTime / latticeDt);
+	pendingTime -= steps * latticeDt;
+	if (steps > maxStepsPerFrame) {
+		steps = maxStepsPerFrame;
+		pendingTime = 0.0f;
+	}
+
+	for (int k = 0; k < steps; k++)
+		Step();
+
+	AdvectDye(static_cast<float>(steps));
+}
+
+void LatticeBoltzmann::Step() {
+	pool.ParallelFor(1, size - 1, 8, [this](int begin, int end) {
+		for (int j = begin; j < end; j++)
+			StreamCollideRow(j);
+	});
+
+	for (int i = 0; i < size; i++) {
+		BounceBackCell(i, 0);
+		BounceBackCell(i, size - 1);
+	}
+	for (int j = 1; j < size - 1; j++) {
+		BounceBackCell(0, j);
+		BounceBackCell(size - 1, j);
+	}
+
+	f.swap(fNext);
+}
+
+void LatticeBoltzmann::StreamCollideRow(int j) {
+	const float* src[Q];
+	float* dst[Q];
+	for (int q = 0; q < Q; q++) {
+		src[q] = &f[q * cells + (j - ey[q]) * size - ex[q]];
+		dst[q] = &fNext[q * cells + j * size];
+	}
+	float* r = &rho[j * size];
+	float* u = &ux[j * size];
+	float* v = &uy[j * size];
+
+	// Every interior cell has all eight neighbours, so each plane is read along a contiguous shifted row. The
+	// compilers will not vectorize the scalar loop through the plane pointers, so the cells go 8 or 4 at a time
+	// with intrinsics, in the scalar loop's operation order so every path rounds alike; ex and ey are 0 or +-1,
+	// so their products become adds, subtracts and sign flips.
+	int i = 1;
+
+#if defined(__AVX2__)
+	const __m256 sign8 = _mm256_set1_ps(-0.0f);
+	const __m256 one8 = _mm256_set1_ps(1.0f);
+	const __m256 half8 = _mm256_set1_ps(0.5f);
+	const __m256 three8 = _mm256_set1_ps(3.0f);
+	const __m256 threeHalves8 = _mm256_set1_ps(1.5f);
+	const __m256 omega8 = _mm256_set1_ps(omega);
+
+	for (; i + 8 <= size - 1; i += 8) {
+		__m256 fi[Q];
+		for (int q = 0; q < Q; q++)
+			fi[q] = _mm256_loadu_ps(src[q] + i);
+
+		__m256 cellRho = fi[0];
+		for (int q = 1; q < Q; q++)
+			cellRho = _mm256_add_ps(cellRho, fi[q]);
+		__m256 momentumX = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(fi[1], fi[3]), fi[5]), fi[6]), fi[7]), fi[8]);
+		__m256 momentumY = _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(fi[2], fi[4]), fi[5]), fi[6]), fi[7]), fi[8]);
+		__m256 rhoRecip = _mm256_div_ps(one8, cellRho);
+		__m256 velocityX = _mm256_mul_ps(momentumX, rhoRecip);
+		__m256 velocityY = _mm256_mul_ps(momentumY, rhoRecip);
+		__m256 usq = _mm256_mul_ps(threeHalves8, _mm256_add_ps(_mm256_mul_ps(velocityX, velocityX), _mm256_mul_ps(velocityY, velocityY)));
+
+		for (int q = 0; q < Q; q++) {
+			__m256 along = _mm256_setzero_ps();
+			if (ex[q] != 0)
+				along = ex[q] > 0 ? velocityX : _mm256_xor_ps(velocityX, sign8);
+			if (ey[q] != 0)
+				along = _mm256_add_ps(along, ey[q] > 0 ? velocityY : _mm256_xor_ps(velocityY, sign8));
+			__m256 eu = _mm256_mul_ps(three8, along);
+			__m256 shape = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(one8, eu), _mm256_mul_ps(_mm256_mul_ps(half8, eu), eu)), usq);
+			__m256 feq = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(weight[q]), cellRho), shape);
+			_mm256_storeu_ps(dst[q] + i, _mm256_add_ps(fi[q], _mm256_mul_ps(omega8, _mm256_sub_ps(feq, fi[q]))));
+		}
+
+		_mm256_storeu_ps(r + i, cellRho);
+		_mm256_storeu_ps(u + i, velocityX);
+		_mm256_storeu_ps(v + i, velocityY);
+	}
+#elif defined(LATTICE_BOLTZMANN_SSE2)
+	const __m128 sign4 = _mm_set1_ps(-0.0f);
+	const __m128 one4 = _mm_set1_ps(1.0f);
+	const __m128 half4 = _mm_set1_ps(0.5f);
+	const __m128 three4 = _mm_set1_ps(3.0f);
+	const __m128 threeHalves4 = _mm_set1_ps(1.5f);
+	const __m128 omega4 = _mm_set1_ps(omega);
+
+	for (; i + 4 <= size - 1; i += 4) {
+		__m128 fi[Q];
+		for (int q = 0; q < Q; q++)
+			fi[q] = _mm_loadu_ps(src[q] + i);
+
+		__m128 cellRho = fi[0];
+		for (int q = 1; q < Q; q++)
+			cellRho = _mm_add_ps(cellRho, fi[q]);
+		__m128 momentumX = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_sub_ps(fi[1], fi[3]), fi[5]), fi[6]), fi[7]), fi[8]);
+		__m128 momentumY = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_sub_ps(fi[2], fi[4]), fi[5]), fi[6]), fi[7]), fi[8]);
+		__m128 rhoRecip = _mm_div_ps(one4, cellRho);
+		__m128 velocityX = _mm_mul_ps(momentumX, rhoRecip);
+		__m128 velocityY = _mm_mul_ps(momentumY, rhoRecip);
+		__m128 usq = _mm_mul_ps(threeHalves4, _mm_add_ps(_mm_mul_ps(velocityX, velocityX), _mm_mul_ps(velocityY, velocityY)));
+
+		for (int q = 0; q < Q; q++) {
+			__m128 along = _mm_setzero_ps();
+			if (ex[q] != 0)
+				along = ex[q] > 0 ? velocityX : _mm_xor_ps(velocityX, sign4);
+			if (ey[q] != 0)
+				along = _mm_add_ps(along, ey[q] > 0 ? velocityY : _mm_xor_ps(velocityY, sign4));
+			__m128 eu = _mm_mul_ps(three4, along);
+			__m128 shape = _mm_sub_ps(_mm_add_ps(_mm_add_ps(one4, eu), _mm_mul_ps(_mm_mul_ps(half4, eu), eu)), usq);
+			__m128 feq = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(weight[q]), cellRho), shape);
+			_mm_storeu_ps(dst[q] + i, _mm_add_ps(fi[q], _mm_mul_ps(omega4, _mm_sub_ps(feq, fi[q]))));
+		}
+
+		_mm_storeu_ps(r + i, cellRho);
+		_mm_storeu_ps(u + i, velocityX);
+		_mm_storeu_ps(v + i, velocityY);
+	}
+#endif
+
+	for (; i < size - 1; i++) {
+		float fi[Q];
+		for (int q = 0; q < Q; q++)
+			fi[q] = src[q][i];
+
+		float cellRho = 0.0f, momentumX = 0.0f, momentumY = 0.0f;
+		for (int q = 0; q < Q; q++) {
+			cellRho += fi[q];
+			momentumX += ex[q] * fi[q];
+			momentumY += ey[q] * fi[q];
+		}
+		float rhoRecip = 1.0f / cellRho;
+		float velocityX = momentumX * rhoRecip;
+		float velocityY = momentumY * rhoRecip;
+		float usq = 1.5f * (velocityX * velocityX + velocityY * velocityY);
+
+		for (int q = 0; q < Q; q++) {
+			float eu = 3.0f * (ex[q] * velocityX + ey[q] * velocityY);
+			float feq = weight[q] * cellRho * (1.0f + eu + 0.5f * eu * eu - usq);
+			dst[q][i] = fi[q] + omega * (feq - fi[q]);
+		}
+
+		r[i] = cellRho;
+		u[i] = velocityX;
+		v[i] = velocityY;
+	}
+}
+
+void LatticeBoltzmann::BounceBackCell(int i, int j) {
+	int index = (j * size) + i;
+	for (int q = 0; q < Q; q++) {
+		int x = i - ex[q];
+		int y = j - ey[q];
+		float incoming = (x < 0 || x > size - 1 || y < 0 || y > size - 1)
+			? f[opposite[q] * cells + index]
+			: f[q * cells + (y * size) + x];
+		fNext[opposite[q] * cells + index] = incoming;
+	}
+}
+
+void LatticeBoltzmann::AdvectDye(float steps) {
+	if (steps <= 0.0f)
+		return;
+
+	s.swap(density);
+	float lo = 0.5f;
+	float hi = static_cast<float>(size) - 1.5f;
+
+	pool.ParallelFor(1, size - 1, 16, [this, steps, lo, hi](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			for (int i = 1; i < size - 1; i++) {
+				int index = (j * size) + i;
+				float x = static_cast<float>(i) - steps * ux[index];
+				float y = static_cast<float>(j) - steps * uy[index];
+				x = x < lo ? lo : (x > hi ? hi : x);
+				y = y < lo ? lo : (y > hi ? hi : y);
+
+				int i0 = static_cast<int>(x);
+				int j0 = static_cast<int>(y);
+				float s1 = x - i0, s0 = 1.0f - s1;
+				float t1 = y - j0, t0 = 1.0f - t1;
+
+				int base = (j0 * size) + i0;
+				density[index] =
+					s0 * (t0 * s[base] + t1 * s[base + size]) +
+					s1 * (t0 * s[base + 1] + t1 * s[base + size + 1]);
+			}
+		}
+	});
+
+	for (int i = 0; i < size; i++) {
+		density[i] = s[i];
+		density[(size - 1) * size + i] = s[(size - 1) * size + i];
+	}
+	for (int j = 1; j < size - 1; j++) {
+		density[j * size] = s[j * size];
+		density[j * size + size - 1] = s[j * size + size - 1];
+	}
+}
+
+void LatticeBoltzmann::Clean() {
+	Simulation::Clean();
+	std::fill(s.begin(), s.end(), 0.0f);
+	Reset();
+}
+
+#endif
@@ -0,0 +1,414 @@
+#pragma once
+#ifndef PARTICLE_FLUID_H
+#define PARTICLE_FLUID_H
+
+#include "Simulation.h"
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PARTICLE_FLUID_SSE2
+#include <emmintrin.h>
+#endif
+
+// Weakly compressible SPH engine. Lengths are in grid cells and the smoothing radius is one cell, so the
+// grid itself is the spatial hash: particles are counting-sorted by cell every step and each neighbour
+// search scans the 3x3 block of cells around a particle.
+class ParticleFluid : public Simulation {
+private:
+	struct Impulse {
+		int x, y;
+		glm::vec2 amount;
+	};
+
+	const int cells;
+	int maxParticles = 1 << 20;
+	int count = 0;
+
+	// Spawning: dye carried by each particle, and the spacing that sets the rest density
+	float dyePerParticle = 750.0f;
+	float spacing = 0.5f;
+
+	float mass = 1.0f;
+	float restDensity;
+	float stiffness = 16000.0f;
+	float kinematicViscosity;
+	float gravity = -50.0f;
+
+	// Substeps keep 0.4 smoothing radii per step; time past maxSubsteps per frame is dropped
+	float maxSpeed;
+	int maxSubsteps = 8;
+
+	float poly6;
+	float spikyGradient;
+	float viscosityLaplacian;
+
+	std::vector<float> px, py;
+	std::vector<float> vx, vy;
+	std::vector<float> rho;
+	std::vector<float> pressure;
+	std::vector<float> ax, ay;
+
+	std::vector<int> cellOf;
+	std::vector<int> cellStart;
+	std::vector<std::atomic<int>> cellCursor;
+
+	std::vector<float> sortX, sortY, sortVx, sortVy;
+
+	std::vector<Impulse> impulses;
+	unsigned int spawnSeed = 1;
+
+	ThreadPool pool;
+
+private:
+	int CellAt(float x, float y) const;
+	float Jitter();
+
+	void BuildCells();
+	void ApplyImpulses();
+	void ComputeDensity(int begin, int end);
+	void ComputeForces(int begin, int end);
+	void Integrate(int begin, int end, float dt);
+	void SplatDensity();
+
+public:
+	ParticleFluid(const int& grid_size, const float& diffusion, const float& viscocity);
+
+	void AddDensity(int x, int y, float amount) override;
+	void AddVelocity(int x, int y, glm::vec2 amount) override;
+
+	void Update(const float& dt) override;
+
+	void Clean() override;
+};
+
+#ifdef PARTICLE_FLUID_SSE2
+namespace ParticleKernel {
+	inline float Sum4(__m128 x) {
+		__m128 pairs = _mm_add_ps(x, _mm_movehl_ps(x, x));
+		return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+	}
+}
+#endif
+
+ParticleFluid::ParticleFluid(const int& grid_size, const float& /* diffusion */, const float& viscocity)
+	: Simulation(grid_size), cells(grid_size * grid_size), cellCursor(grid_size * grid_size) {
+
+	const float pi = 3.14159265f;
+	poly6 = 4.0f / pi;
+	spikyGradient = -30.0f / pi;
+	viscosityLaplacian = 40.0f / pi;
+
+	// Same scaling as Fluid::Diffuse; diffusion has no particle counterpart since dye rides on the particles
+	kinematicViscosity = viscocity * (size - 2) * (size - 2);
+	maxSpeed = std::sqrt(stiffness);
+
+	restDensity = 0.0f;
+	for (int j = -4; j <= 4; j++) {
+		for (int i = -4; i <= 4; i++) {
+			float r2 = (i * i + j * j) * spacing * spacing;
+			if (r2 < 1.0f)
+				restDensity += mass * poly6 * (1.0f - r2) * (1.0f - r2) * (1.0f - r2);
+		}
+	}
+
+	px = py = vx = vy = rho = pressure = ax = ay = std::vector<float>(maxParticles);
+	sortX = sortY = sortVx = sortVy = std::vector<float>(maxParticles);
+	cellOf = std::vector<int>(maxParticles);
+	cellStart = std::vector<int>(cells + 1);
+}
+
+int ParticleFluid::CellAt(float x, float y) const {
+	int i = static_cast<int>(x);
+	int j = static_cast<int>(y);
+	if (i < 0) { i = 0; }
+	if (i > size - 1) { i = size - 1; }
+	if (j < 0) { j = 0; }
+	if (j > size - 1) { j = size - 1; }
+	return (j * size) + i;
+}
+
+float ParticleFluid::Jitter() {
+	spawnSeed = spawnSeed * 1664525u + 1013904223u;
+	return static_cast<float>(spawnSeed >> 8) / 16777216.0f;
+}
+
+void ParticleFluid::AddDensity(int x, int y, float amount) {
+	if (x < 1 || x > size - 2 || y < 1 || y > size - 2)
+		return;
+
+	int spawn = static_cast<int>(amount / dyePerParticle);
+	for (int k = 0; k < spawn && count < maxParticles; k++, count++) {
+		px[count] = static_cast<float>(x) + Jitter();
+		py[count] = static_cast<float>(y) + Jitter();
+		vx[count] = 0.0f;
+		vy[count] = 0.0f;
+	}
+}
+
+void ParticleFluid::AddVelocity(int x, int y, glm::vec2 amount) {
+	impulses.push_back({ x, y, amount });
+}
+
+void ParticleFluid::Update(const float& dt) {
+	int substeps = static_cast<int>(std::ceil(dt * maxSpeed / 0.4f));
+	if (substeps > maxSubsteps) { substeps = maxSubsteps; }
+	float h = (substeps > 0) ? dt / substeps : 0.0f;
+	if (h * maxSpeed > 0.4f) { h = 0.4f / maxSpeed; }
+
+	for (int k = 0; k < substeps; k++) {
+		BuildCells();
+		if (k == 0)
+			ApplyImpulses();
+
+		pool.ParallelFor(0, count, 4096, [this](int begin, int end) { ComputeDensity(begin, end); });
+		pool.ParallelFor(0, count, 4096, [this](int begin, int end) { ComputeForces(begin, end); });
+		pool.ParallelFor(0, count, 4096, [this, h](int begin, int end) { Integrate(begin, end, h); });
+	}
+
+	BuildCells();
+	if (substeps == 0)
+		ApplyImpulses();
+	SplatDensity();
+}
+
+void ParticleFluid::BuildCells() {
+	pool.ParallelFor(0, cells, 16384, [this](int begin, int end) {
+		for (int c = begin; c < end; c++)
+			cellCursor[c].store(0, std::memory_order_relaxed);
+	});
+
+	pool.ParallelFor(0, count, 4096, [this](int begin, int end) {
+		for (int k = begin; k < end; k++) {
+			cellOf[k] = CellAt(px[k], py[k]);
+			cellCursor[cellOf[k]].fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+
+	int offset = 0;
+	for (int c = 0; c < cells; c++) {
+		cellStart[c] = offset;
+		offset += cellCursor[c].load(std::memory_order_relaxed);
+		cellCursor[c].store(cellStart[c], std::memory_order_relaxed);
+	}
+	cellStart[cells] = offset;
+
+	pool.ParallelFor(0, count, 4096, [this](int begin, int end) {
+		for (int k = begin; k < end; k++) {
+			int slot = cellCursor[cellOf[k]].fetch_add(1, std::memory_order_relaxed);
+			sortX[slot] = px[k];
+			sortY[slot] = py[k];
+			sortVx[slot] = vx[k];
+			sortVy[slot] = vy[k];
+		}
+	});
+
+	px.swap(sortX);
+	py.swap(sortY);
+	vx.swap(sortVx);
+	vy.swap(sortVy);
+}
+
+void ParticleFluid::ApplyImpulses() {
+	for (const Impulse& impulse : impulses) {
+		if (impulse.x < 1 || impulse.x > size - 2 || impulse.y < 1 || impulse.y > size - 2)
+			continue;
+
+		// Fluid's velocities are in domain widths per second and a domain width is size - 2 cells, as in its
+		// backtrace; strokes faster than maxSpeed are capped when the particles integrate
+		int c = (impulse.y * size) + impulse.x;
+		float dvx = impulse.amount.x * (size - 2);
+		float dvy = impulse.amount.y * (size - 2);
+		for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+			vx[k] += dvx;
+			vy[k] += dvy;
+		}
+	}
+	impulses.clear();
+}
+
+void ParticleFluid::ComputeDensity(int begin, int end) {
+	for (int k = begin; k < end; k++) {
+		int ci = static_cast<int>(px[k]);
+		int cj = static_cast<int>(py[k]);
+		float x = px[k], y = py[k];
+		float sum = 0.0f;
+
+#ifdef PARTICLE_FLUID_SSE2
+		const __m128 x4 = _mm_set1_ps(x), y4 = _mm_set1_ps(y);
+		const __m128 one4 = _mm_set1_ps(1.0f), zero4 = _mm_setzero_ps();
+		__m128 sum4 = zero4;
+#endif
+
+		for (int j = cj - 1; j <= cj + 1; j++) {
+			if (j < 0 || j > size - 1)
+				continue;
+			int first = cellStart[(j * size) + (ci > 0 ? ci - 1 : 0)];
+			int last = cellStart[(j * size) + (ci < size - 1 ? ci + 1 : size - 1) + 1];
+			int n = first;
+
+			// Cells in a row are contiguous after the sort, so the three of them form one branch-free run, taken
+			// four neighbours at a time
+#ifdef PARTICLE_FLUID_SSE2
+			for (; n + 4 <= last; n += 4) {
+				__m128 dx = _mm_sub_ps(x4, _mm_loadu_ps(&px[n]));
+				__m128 dy = _mm_sub_ps(y4, _mm_loadu_ps(&py[n]));
+				__m128 q = _mm_max_ps(_mm_sub_ps(one4, _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))), zero4);
+				sum4 = _mm_add_ps(sum4, _mm_mul_ps(_mm_mul_ps(q, q), q));
+			}
+#endif
+			for (; n < last; n++) {
+				float dx = x - px[n];
+				float dy = y - py[n];
+				float q = 1.0f - (dx * dx + dy * dy);
+				q = q > 0.0f ? q : 0.0f;
+				sum += q * q * q;
+			}
+		}
+#ifdef PARTICLE_FLUID_SSE2
+		sum += ParticleKernel::Sum4(sum4);
+#endif
+
+		rho[k] = mass * poly6 * sum;
+		float p = stiffness * (rho[k] - restDensity);
+		pressure[k] = p > 0.0f ? p : 0.0f;
+	}
+}
+
+void ParticleFluid::ComputeForces(int begin, int end) {
+	for (int k = begin; k < end; k++) {
+		int ci = static_cast<int>(px[k]);
+		int cj = static_cast<int>(py[k]);
+		float x = px[k], y = py[k];
+		float u = vx[k], v = vy[k];
+		float pk = pressure[k];
+		float fx = 0.0f, fy = 0.0f;
+
+#ifdef PARTICLE_FLUID_SSE2
+		const __m128 x4 = _mm_set1_ps(x), y4 = _mm_set1_ps(y);
+		const __m128 u4 = _mm_set1_ps(u), v4 = _mm_set1_ps(v);
+		const __m128 pk4 = _mm_set1_ps(pk);
+		const __m128 one4 = _mm_set1_ps(1.0f), zero4 = _mm_setzero_ps();
+		const __m128 epsilon4 = _mm_set1_ps(1e-6f);
+		const __m128 mass4 = _mm_set1_ps(mass);
+		const __m128 pushScale4 = _mm_set1_ps(-0.5f * spikyGradient);
+		const __m128 dragScale4 = _mm_set1_ps(kinematicViscosity * viscosityLaplacian);
+		__m128 fx4 = zero4, fy4 = zero4;
+#endif
+
+		for (int j = cj - 1; j <= cj + 1; j++) {
+			if (j < 0 || j > size - 1)
+				continue;
+			int first = cellStart[(j * size) + (ci > 0 ? ci - 1 : 0)];
+			int last = cellStart[(j * size) + (ci < size - 1 ? ci + 1 : size - 1) + 1];
+			int n = first;
+
+#ifdef PARTICLE_FLUID_SSE2
+			for (; n + 4 <= last; n += 4) {
+				__m128 dx = _mm_sub_ps(x4, _mm_loadu_ps(&px[n]));
+				__m128 dy = _mm_sub_ps(y4, _mm_loadu_ps(&py[n]));
+				__m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+				__m128 q = _mm_sub_ps(one4, r);
+				q = _mm_and_ps(q, _mm_and_ps(_mm_cmpgt_ps(q, zero4), _mm_cmpgt_ps(r, epsilon4)));
+
+				__m128 shared = _mm_div_ps(mass4, _mm_loadu_ps(&rho[n]));
+				__m128 push = _mm_mul_ps(_mm_mul_ps(shared, pushScale4), _mm_add_ps(pk4, _mm_loadu_ps(&pressure[n])));
+				push = _mm_div_ps(_mm_mul_ps(_mm_mul_ps(push, q), q), _mm_add_ps(r, epsilon4));
+				__m128 drag = _mm_mul_ps(_mm_mul_ps(shared, dragScale4), q);
+
+				fx4 = _mm_add_ps(fx4, _mm_add_ps(_mm_mul_ps(push, dx), _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&vx[n]), u4))));
+				fy4 = _mm_add_ps(fy4, _mm_add_ps(_mm_mul_ps(push, dy), _mm_mul_ps(drag, _mm_sub_ps(_mm_loadu_ps(&vy[n]), v4))));
+			}
+#endif
+			for (; n < last; n++) {
+				float dx = x - px[n];
+				float dy = y - py[n];
+				float r = std::sqrt(dx * dx + dy * dy);
+				float q = 1.0f - r;
+				q = (q > 0.0f && r > 1e-6f) ? q : 0.0f;
+
+				float shared = mass / rho[n];
+				float push = -shared * 0.5f * (pk + pressure[n]) * spikyGradient * q * q / (r + 1e-6f);
+				float drag = shared * kinematicViscosity * viscosityLaplacian * q;
+
+				fx += push * dx + drag * (vx[n] - u);
+				fy += push * dy + drag * (vy[n] - v);
+			}
+		}
+#ifdef PARTICLE_FLUID_SSE2
+		fx += ParticleKernel::Sum4(fx4);
+		fy += ParticleKernel::Sum4(fy4);
+#endif
+
+		ax[k] = fx / rho[k];
+		ay[k] = fy / rho[k] + gravity;
+	}
+}
+
+void ParticleFluid::Integrate(int begin, int end, float dt) {
+	float lo = 1.0f;
+	float hi = static_cast<float>(size - 1) - 1e-3f;
+
+	for (int k = begin; k < end; k++) {
+		float u = vx[k] + dt * ax[k];
+		float v = vy[k] + dt * ay[k];
+
+		float speed2 = u * u + v * v;
+		if (speed2 > maxSpeed * maxSpeed) {
+			float scale = maxSpeed / std::sqrt(speed2);
+			u *= scale;
+			v *= scale;
+		}
+
+		float x = px[k] + dt * u;
+		float y = py[k] + dt * v;
+		if (x < lo) { x = lo; u = -0.5f * u; }
+		if (x > hi) { x = hi; u = -0.5f * u; }
+		if (y < lo) { y = lo; v = -0.5f * v; }
+		if (y > hi) { y = hi; v = -0.5f * v; }
+
+		px[k] = x;
+		py[k] = y;
+		vx[k] = u;
+		vy[k] = v;
+	}
+}
+
+void ParticleFluid::SplatDensity() {
+	// Gathered per cell with a tent filter over the neighbouring cells' particles, so no two threads write the same cell
+	pool.ParallelFor(0, size, 8, [this](int begin, int end) {
+		for (int j = begin; j < end; j++) {
+			for (int i = 0; i < size; i++) {
+				float cx = static_cast<float>(i) + 0.5f;
+				float cy = static_cast<float>(j) + 0.5f;
+				float sum = 0.0f;
+
+				for (int nj = j - 1; nj <= j + 1; nj++) {
+					if (nj < 0 || nj > size - 1)
+						continue;
+					int first = cellStart[(nj * size) + (i > 0 ? i - 1 : 0)];
+					int last = cellStart[(nj * size) + (i < size - 1 ? i + 1 : size - 1) + 1];
+
+					for (int n = first; n < last; n++) {
+						float wx = 1.0f - std::fabs(px[n] - cx);
+						float wy = 1.0f - std::fabs(py[n] - cy);
+						sum += (wx > 0.0f ? wx : 0.0f) * (wy > 0.0f ? wy : 0.0f);
+					}
+				}
+
+				density[(j * size) + i] = dyePerParticle * sum;
+			}
+		}
+	});
+}
+
+void ParticleFluid::Clean() {
+	Simulation::Clean();
+	count = 0;
+	impulses.clear();
+}
+
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtx/color_space.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Common interface of the simulation engines: mouse injections in, a size x size dye field out for Draw
+class Simulation {
+protected:
+	enum class ColorSpace { GRAYSCALE, HSV };
+
+	const int size;
+
+	std::vector<float> density;
+
+	ColorSpace renderColorSpace;
+
+	// Set whenever every pixel may be stale, for engines that redraw only what changed
+	bool redrawAll = true;
+
+protected:
+	Simulation(const int& grid_size);
+
+	glm::vec4 Pixel(float value) const;
+
+public:
+	virtual ~Simulation() = default;
+
+	virtual void AddDensity(int x, int y, float amount) = 0;
+	virtual void AddVelocity(int x, int y, glm::vec2 amount) = 0;
+
+	virtual void Update(const float& dt) = 0;
+	virtual void Draw(void* ptr);
+
+	virtual void Clean();
+	void SetGrayscaleSpace();
+	void SetHSVSpace();
+	void PrintDensity();
+
+	std::vector<glm::vec4> densityPixel;
+};
+
+Simulation::Simulation(const int& grid_size)
+	: size(grid_size), renderColorSpace(ColorSpace::GRAYSCALE) {
+
+	density = std::vector<float>(size * size);
+	densityPixel = std::vector<glm::vec4>(size * size);
+}
+
+glm::vec4 Simulation::Pixel(float value) const {
+	return (renderColorSpace == ColorSpace::HSV)
+		? glm::vec4(glm::rgbColor(glm::vec3(value, 1.0f, 1.0f)), 1.0f)
+		: glm::vec4(glm::vec3(value) / 255.0f, 1.0f);
+}
+
+void Simulation::Draw(void* ptr) {
+	for (int i = 0; i < size; ++i) {
+		for (int j = 0; j < size; ++j) {
+			int index = (j * size) + i;
+			densityPixel[index] = Pixel(density[index]);
+		}
+	}
+	memcpy(ptr, densityPixel.data(), densityPixel.size() * sizeof(glm::vec4));
+	redrawAll = false;
+}
+
+void Simulation::Clean() {
+	std::fill(density.begin(), density.end(), 0.0f);
+	std::fill(densityPixel.begin(), densityPixel.end(), glm::vec4(0.0f));
+	redrawAll = true;
+}
+
+void Simulation::SetGrayscaleSpace() {
+	renderColorSpace = ColorSpace::GRAYSCALE;
+	redrawAll = true;
+}
+
+void Simulation::SetHSVSpace() {
+	renderColorSpace = ColorSpace::HSV;
+	redrawAll = true;
+}
+
+void Simulation::PrintDensity() {
+	for (int i = 0; i < size; ++i) {
+		for (int j = 0; j < size; ++j)
+			std::cout << density[(j * size) + i] << "\t";
+		std::cout << "\n";
+	}
+	std::cout << "\n";
+}
+
+#endif
@@ -0,0 +1,404 @@
+#pragma once
+#ifndef STATIC_FLUID_H
+#define STATIC_FLUID_H
+
+#include "Boundary.h"
+#include "Simulation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Fluid's default velocity-pressure step with the grid size and precision fixed at compile time, so every loop
+// bound, stride and (N - 2)^2 factor is a constant the optimizer can unroll and vectorize around. It keeps none
+// of Fluid's runtime options (solver backends, layouts, schemes, tuning, sparse tiles, threads), so it is opt-in.
+// Boundaries is a Boundary::Sides naming the policy of each side, so the ghost-cell rules are resolved at compile time.
+template <int N, typename Real = float, typename Boundaries = Boundary::Box>
+class StaticFluid : public Simulation {
+	static_assert(N >= 4, "StaticFluid needs at least two interior cells per side");
+
+private:
+	using Left = typename Boundaries::Left;
+	using Right = typename Boundaries::Right;
+	using Bottom = typename Boundaries::Bottom;
+	using Top = typename Boundaries::Top;
+
+	// SetBnd field codes: the dye, the x and y velocity components, and the pressure
+	enum { SCALAR = 0, VELOCITY_X = 1, VELOCITY_Y = 2, PRESSURE = 3 };
+
+	static constexpr int cells = N * N;
+	static constexpr int iterations = 16;
+
+	const Real diff;
+	const Real visc;
+	const Real diffusionTolerance = static_cast<Real>(0.01);
+
+	std::vector<Real> pVx;
+	std::vector<Real> pVy;
+	std::vector<Real> Vx;
+	std::vector<Real> Vy;
+	std::vector<Real> s;
+	std::vector<Real> dye;
+
+	// Face values held by Inflow sides (velocity along the side's axis, dye), which the sponge layers of open sides
+	// also relax toward
+	Real inflowVelocity = 0;
+	Real inflowDye = 0;
+	int spongeCells = 8;
+	Real spongeStrength = 10;
+
+	// Same frame splitting as Fluid::Update: substeps of at most cflLimit cells of travel, up to maxSubsteps, and
+	// frames past maxFrameTime simulated as that long. The peak speed is measured at the start of each frame.
+	float cflLimit = 32.0f;
+	int maxSubsteps = 8;
+	float maxFrameTime = 0.1f;
+
+private:
+	static constexpr int IndexAt(int x, int y);
+	static constexpr Boundary::Field FieldAcross(int b, bool xSide);
+
+	template <int B> void SetBnd(std::vector<Real>& x) const;
+	template <int B> void LinSolve(std::vector<Real>& x, const std::vector<Real>& x0, Real a, Real c) const;
+	template <int B> void Diffuse(std::vector<Real>& x, const std::vector<Real>& x0, Real rate, Real dt) const;
+	void ClearDivergence(std::vector<Real>& vx, std::vector<Real>& vy, std::vector<Real>& p, std::vector<Real>& div) const;
+	template <int B> void Advect(std::vector<Real>& d, const std::vector<Real>& d0, const std::vector<Real>& vx, const std::vector<Real>& vy, Real dt) const;
+	void ApplySponge(Real dt);
+	void Relax(int index, Real targetX, Real targetY, Real weight);
+	void Step(Real step);
+
+public:
+	StaticFluid(const float& diffusion, const float& viscocity);
+
+	void SetInflow(float velocity, float dye);
+	void SetSponge(int cells, float strength);
+	void SetCflLimit(float limit, int substeps = 8);
+	void SetMaxFrameTime(float seconds);
+
+	void AddDensity(int x, int y, float amount) override;
+	void AddVelocity(int x, int y, glm::vec2 amount) override;
+
+	void Update(const float& dt) override;
+
+	void Clean() override;
+};
+
+// Compile-time instances for the common grid sizes, or nullptr so the caller can use the runtime Fluid
+inline Simulation* CreateStaticFluid(int grid_size, float diffusion, float viscocity) {
+	switch (grid_size) {
+	case 128: return new StaticFluid<128>(diffusion, viscocity);
+	case 256: return new StaticFluid<256>(diffusion, viscocity);
+	case 512: return new StaticFluid<512>(diffusion, viscocity);
+	case 1024: return new StaticFluid<1024>(diffusion, viscocity);
+	default: return nullptr;
+	}
+}
+
+template <int N, typename Real, typename Boundaries>
+StaticFluid<N, Real, Boundaries>::StaticFluid(const float& diffusion, const float& viscocity)
+	: Simulation(N), diff(static_cast<Real>(diffusion)), visc(static_cast<Real>(viscocity)) {
+
+	pVx = std::vector<Real>(cells);
+	pVy = std::vector<Real>(cells);
+	Vx = std::vector<Real>(cells);
+	Vy = std::vector<Real>(cells);
+	s = std::vector<Real>(cells);
+	dye = std::vector<Real>(cells);
+}
+
+template <int N, typename Real, typename Boundaries>
+constexpr int StaticFluid<N, Real, Boundaries>::IndexAt(int x, int y) {
+	x = x < 0 ? 0 : (x > N - 1 ? N - 1 : x);
+	y = y < 0 ? 0 : (y > N - 1 ? N - 1 : y);
+	return (y * N) + x;
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::AddDensity(int x, int y, float amount) {
+	dye[IndexAt(x, y)] += static_cast<Real>(amount);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::AddVelocity(int x, int y, glm::vec2 amount) {
+	int index = IndexAt(x, y);
+	Vx[index] += static_cast<Real>(amount.x);
+	Vy[index] += static_cast<Real>(amount.y);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::SetInflow(float velocity, float dye) {
+	inflowVelocity = static_cast<Real>(velocity);
+	inflowDye = static_cast<Real>(dye);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::SetSponge(int cells, float strength) {
+	spongeCells = cells > 0 ? cells : 0;
+	spongeStrength = static_cast<Real>(strength);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::SetCflLimit(float limit, int substeps) {
+	cflLimit = limit;
+	maxSubsteps = (substeps < 1) ? 1 : substeps;
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::SetMaxFrameTime(float seconds) {
+	maxFrameTime = seconds;
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::Update(const float& dt) {
+	if (!(dt > 0.0f))
+		return;
+	float frame = std::min(dt, maxFrameTime);
+
+	int steps = 1;
+	if (cflLimit > 0.0f) {
+		Real peak = 0;
+		for (int index = 0; index < cells; index++)
+			peak = std::max(peak, std::max(std::fabs(Vx[index]), std::fabs(Vy[index])));
+
+		// Clamped before the cast, as in Fluid::Update, so an infinite or NaN speed cannot overflow it
+		float ratio = frame * static_cast<float>(N - 2) * static_cast<float>(peak) / cflLimit;
+		if (!(ratio <= static_cast<float>(maxSubsteps)))
+			ratio = static_cast<float>(maxSubsteps);
+		steps = std::max(static_cast<int>(std::ceil(ratio)), 1);
+	}
+
+	Real step = static_cast<Real>(frame / steps);
+	for (int k = 0; k < steps; k++)
+		Step(step);
+
+	for (int index = 0; index < cells; index++)
+		density[index] = static_cast<float>(dye[index]);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::Step(Real step) {
+	Diffuse<VELOCITY_X>(pVx, Vx, visc, step);
+	Diffuse<VELOCITY_Y>(pVy, Vy, visc, step);
+
+	ClearDivergence(pVx, pVy, Vx, Vy);
+
+	Advect<VELOCITY_X>(Vx, pVx, pVx, pVy, step);
+	Advect<VELOCITY_Y>(Vy, pVy, pVx, pVy, step);
+	ApplySponge(step);
+
+	ClearDivergence(Vx, Vy, pVx, pVy);
+
+	Diffuse<SCALAR>(s, dye, diff, step);
+	Advect<SCALAR>(dye, s, Vx, Vy, step);
+}
+
+template <int N, typename Real, typename Boundaries>
+constexpr Boundary::Field StaticFluid<N, Real, Boundaries>::FieldAcross(int b, bool xSide) {
+	return b == VELOCITY_X ? (xSide ? Boundary::Field::NORMAL : Boundary::Field::TANGENTIAL)
+		: b == VELOCITY_Y ? (xSide ? Boundary::Field::TANGENTIAL : Boundary::Field::NORMAL)
+		: b == PRESSURE ? Boundary::Field::PRESSURE
+		: Boundary::Field::SCALAR;
+}
+
+template <int N, typename Real, typename Boundaries>
+template <int B>
+void StaticFluid<N, Real, Boundaries>::SetBnd(std::vector<Real>& x) const {
+	// The field each side sees is fixed by B, so every loop below is a straight copy with the policy inlined
+	const Boundary::Field acrossX = FieldAcross(B, true);
+	const Boundary::Field acrossY = FieldAcross(B, false);
+	const Real valueX = acrossX == Boundary::Field::NORMAL ? inflowVelocity : (acrossX == Boundary::Field::SCALAR ? inflowDye : 0);
+	const Real valueY = acrossY == Boundary::Field::NORMAL ? inflowVelocity : (acrossY == Boundary::Field::SCALAR ? inflowDye : 0);
+
+	for (int i = 1; i < N - 1; i++) {
+		x[i] = Bottom::template Ghost<FieldAcross(B, false), Real>(x[N + i], x[(N - 2) * N + i], valueY);
+		x[(N - 1) * N + i] = Top::template Ghost<FieldAcross(B, false), Real>(x[(N - 2) * N + i], x[N + i], valueY);
+	}
+	for (int j = 1; j < N - 1; j++) {
+		x[j * N] = Left::template Ghost<FieldAcross(B, true), Real>(x[j * N + 1], x[j * N + N - 2], valueX);
+		x[j * N + N - 1] = Right::template Ghost<FieldAcross(B, true), Real>(x[j * N + N - 2], x[j * N + 1], valueX);
+	}
+
+	// Corners continue the wrap along a periodic axis, otherwise they average their neighbours like Fluid::SetBnd
+	if (Left::periodic) {
+		x[0] = x[N - 2];
+		x[N - 1] = x[1];
+		x[(N - 1) * N] = x[(N - 1) * N + N - 2];
+		x[(N - 1) * N + N - 1] = x[(N - 1) * N + 1];
+		return;
+	}
+	if (Bottom::periodic) {
+		x[0] = x[(N - 2) * N];
+		x[N - 1] = x[(N - 2) * N + N - 1];
+		x[(N - 1) * N] = x[N];
+		x[(N - 1) * N + N - 1] = x[N + N - 1];
+		return;
+	}
+
+	const Real third = static_cast<Real>(0.33);
+	x[0] = third * (x[1] + x[N] + x[0]);
+	x[N - 1] = third * (x[N - 2] + x[N + N - 1] + x[N - 1]);
+	x[(N - 1) * N] = third * (x[(N - 1) * N + 1] + x[(N - 2) * N] + x[(N - 1) * N]);
+	x[(N - 1) * N + N - 1] = third * (x[(N - 1) * N + N - 2] + x[(N - 2) * N + N - 1] + x[(N - 1) * N + N - 1]);
+}
+
+template <int N, typename Real, typename Boundaries>
+template <int B>
+void StaticFluid<N, Real, Boundaries>::LinSolve(std::vector<Real>& x, const std::vector<Real>& x0, Real a, Real c) const {
+	// Everything but the left neighbour is known before a row starts, so that part is a straight pass of N - 2
+	// cells the compiler vectorizes, and the sweep's serial chain shrinks to one multiply-add per cell. Same
+	// Gauss-Seidel update as Fluid::LinSolveRow, rounded in a different order.
+	Real cRecip = static_cast<Real>(1) / c;
+	Real leftWeight = a * cRecip;
+	Real known[N];
+
+	for (int k = 0; k < iterations; k++) {
+		for (int j = 1; j < N - 1; j++) {
+			Real* row = &x[j * N];
+			const Real* below = row - N;
+			const Real* above = row + N;
+			const Real* src = &x0[j * N];
+			for (int i = 1; i < N - 1; i++)
+				known[i] = (src[i] + a * (row[i + 1] + above[i] + below[i] + row[i] + row[i])) * cRecip;
+			for (int i = 1; i < N - 1; i++)
+				row[i] = known[i] + leftWeight * row[i - 1];
+		}
+		SetBnd<B>(x);
+	}
+}
+
+template <int N, typename Real, typename Boundaries>
+template <int B>
+void StaticFluid<N, Real, Boundaries>::Diffuse(std::vector<Real>& x, const std::vector<Real>& x0, Real rate, Real dt) const {
+	// Same copy / explicit / implicit choice as Fluid::Diffuse
+	Real a = dt * rate * static_cast<Real>(N - 2) * static_cast<Real>(N - 2);
+
+	if (8 * a <= diffusionTolerance) {
+		x = x0;
+		SetBnd<B>(x);
+		return;
+	}
+
+	if (64 * a * a <= diffusionTolerance) {
+		for (int j = 1; j < N - 1; j++) {
+			for (int i = 1; i < N - 1; i++) {
+				int index = (j * N) + i;
+				x[index] = x0[index] + a * (x0[index + 1] + x0[index - 1] + x0[index + N] + x0[index - N] - static_cast<Real>(4) * x0[index]);
+			}
+		}
+		SetBnd<B>(x);
+		return;
+	}
+
+	LinSolve<B>(x, x0, a, 1 + 6 * a);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::ClearDivergence(std::vector<Real>& vx, std::vector<Real>& vy, std::vector<Real>& p, std::vector<Real>& div) const {
+	const Real n = static_cast<Real>(N);
+	const Real half = static_cast<Real>(0.5);
+
+	for (int j = 1; j < N - 1; j++) {
+		for (int i = 1; i < N - 1; i++) {
+			int index = (j * N) + i;
+			div[index] = -half * (vx[index + 1] - vx[index - 1] + vy[index + N] - vy[index - N]) / n;
+			p[index] = 0;
+		}
+	}
+	SetBnd<PRESSURE>(div);
+	SetBnd<PRESSURE>(p);
+
+	LinSolve<PRESSURE>(p, div, 1, 6);
+
+	for (int j = 1; j < N - 1; j++) {
+		for (int i = 1; i < N - 1; i++) {
+			int index = (j * N) + i;
+			vx[index] -= half * (p[index + 1] - p[index - 1]) * n;
+			vy[index] -= half * (p[index + N] - p[index - N]) * n;
+		}
+	}
+	SetBnd<VELOCITY_X>(vx);
+	SetBnd<VELOCITY_Y>(vy);
+}
+
+template <int N, typename Real, typename Boundaries>
+template <int B>
+void StaticFluid<N, Real, Boundaries>::Advect(std::vector<Real>& d, const std::vector<Real>& d0, const std::vector<Real>& vx, const std::vector<Real>& vy, Real dt) const {
+	const Real dt0 = dt * static_cast<Real>(N - 2);
+	const Real lo = static_cast<Real>(0.5);
+	const Real hi = static_cast<Real>(N) + static_cast<Real>(0.5);
+	const Real period = static_cast<Real>(N - 2);
+
+	for (int j = 1; j < N - 1; j++) {
+		for (int i = 1; i < N - 1; i++) {
+			int index = (j * N) + i;
+			Real x = static_cast<Real>(i) - dt0 * vx[index];
+			Real y = static_cast<Real>(j) - dt0 * vy[index];
+
+			// A periodic axis wraps the departure point into the interior, whose ghost cells already hold the wrapped values
+			if (Left::periodic)
+				x -= period * std::floor((x - lo) / period);
+			else
+				x = x < lo ? lo : (x > hi ? hi : x);
+			if (Bottom::periodic)
+				y -= period * std::floor((y - lo) / period);
+			else
+				y = y < lo ? lo : (y > hi ? hi : y);
+
+			int i0 = static_cast<int>(x);
+			int j0 = static_cast<int>(y);
+			Real s1 = x - static_cast<Real>(i0), s0 = 1 - s1;
+			Real t1 = y - static_cast<Real>(j0), t0 = 1 - t1;
+
+			d[index] =
+				s0 * (t0 * d0[IndexAt(i0, j0)] + t1 * d0[IndexAt(i0, j0 + 1)]) +
+				s1 * (t0 * d0[IndexAt(i0 + 1, j0)] + t1 * d0[IndexAt(i0 + 1, j0 + 1)]);
+		}
+	}
+	SetBnd<B>(d);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::ApplySponge(Real dt) {
+	// Open sides relax a band of cells toward the free stream so waves leave the domain instead of bouncing off the
+	// ghost cells; the strength ramps up quadratically toward the side
+	if (!(Left::open || Right::open || Bottom::open || Top::open))
+		return;
+
+	int band = spongeCells < (N - 2) / 2 ? spongeCells : (N - 2) / 2;
+	for (int d = 0; d < band; d++) {
+		Real ramp = static_cast<Real>(band - d) / static_cast<Real>(band);
+		Real weight = spongeStrength * dt * ramp * ramp;
+		weight = weight < 1 ? weight : 1;
+
+		for (int j = 1; j < N - 1; j++) {
+			if (Left::open)
+				Relax((j * N) + 1 + d, inflowVelocity, 0, weight);
+			if (Right::open)
+				Relax((j * N) + N - 2 - d, inflowVelocity, 0, weight);
+		}
+		for (int i = 1; i < N - 1; i++) {
+			if (Bottom::open)
+				Relax(((1 + d) * N) + i, 0, inflowVelocity, weight);
+			if (Top::open)
+				Relax(((N - 2 - d) * N) + i, 0, inflowVelocity, weight);
+		}
+	}
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::Relax(int index, Real targetX, Real targetY, Real weight) {
+	Vx[index] += weight * (targetX - Vx[index]);
+	Vy[index] += weight * (targetY - Vy[index]);
+}
+
+template <int N, typename Real, typename Boundaries>
+void StaticFluid<N, Real, Boundaries>::Clean() {
+	Simulation::Clean();
+	std::fill(pVx.begin(), pVx.end(), static_cast<Real>(0));
+	std::fill(pVy.begin(), pVy.end(), static_cast<Real>(0));
+	std::fill(Vx.begin(), Vx.end(), static_cast<Real>(0));
+	std::fill(Vy.begin(), Vy.end(), static_cast<Real>(0));
+	std::fill(s.begin(), s.end(), static_cast<Real>(0));
+	std::fill(dye.begin(), dye.end(), static_cast<Real>(0));
+}
+
+#endif
@@ -0,0 +1,170 @@
+#pragma once
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STENCIL_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Expression templates for point-wise stencil updates over a padded square grid. An expression is built from
+// Fields, shifted taps of them and float constants, and is evaluated a whole SIMD register at a time, so
+//
+//	Stencil::EvaluateRow(j, n,
+//		Stencil::Assign(div, -0.5f * (u.At(1, 0) - u.At(-1, 0) + v.At(0, 1) - v.At(0, -1)) / n),
+//		Stencil::Assign(p, Stencil::Constant(0.0f)));
+//
+// writes both outputs of row j in one pass. The ring of boundary cells is the padding that keeps every tap of an
+// interior cell in bounds. Outputs are stored one after another for each block of cells, so an output may only be
+// read by a later assignment at its own cell, never through a shifted tap.
+namespace Stencil {
+	template <typename V> struct Lane;
+
+	template <> struct Lane<float> {
+		static float Load(const float* p) { return *p; }
+		static void Store(float* p, float v) { *p = v; }
+		static float Splat(float s) { return s; }
+	};
+
+#ifdef STENCIL_SSE2
+	struct Vec4 { __m128 v; };
+	inline Vec4 operator+(Vec4 a, Vec4 b) { return { _mm_add_ps(a.v, b.v) }; }
+	inline Vec4 operator-(Vec4 a, Vec4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+	inline Vec4 operator*(Vec4 a, Vec4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+	inline Vec4 operator/(Vec4 a, Vec4 b) { return { _mm_div_ps(a.v, b.v) }; }
+
+	template <> struct Lane<Vec4> {
+		static Vec4 Load(const float* p) { return { _mm_loadu_ps(p) }; }
+		static void Store(float* p, Vec4 v) { _mm_storeu_ps(p, v.v); }
+		static Vec4 Splat(float s) { return { _mm_set1_ps(s) }; }
+	};
+#endif
+
+#if defined(__AVX2__)
+	struct Vec8 { __m256 v; };
+	inline Vec8 operator+(Vec8 a, Vec8 b) { return { _mm256_add_ps(a.v, b.v) }; }
+	inline Vec8 operator-(Vec8 a, Vec8 b) { return { _mm256_sub_ps(a.v, b.v) }; }
+	inline Vec8 operator*(Vec8 a, Vec8 b) { return { _mm256_mul_ps(a.v, b.v) }; }
+	inline Vec8 operator/(Vec8 a, Vec8 b) { return { _mm256_div_ps(a.v, b.v) }; }
+
+	template <> struct Lane<Vec8> {
+		static Vec8 Load(const float* p) { return { _mm256_loadu_ps(p) }; }
+		static void Store(float* p, Vec8 v) { _mm256_storeu_ps(p, v.v); }
+		static Vec8 Splat(float s) { return { _mm256_set1_ps(s) }; }
+	};
+#endif
+
+	template <typename E>
+	struct Expr {
+		const E& Self() const { return static_cast<const E&>(*this); }
+	};
+
+	// A field read at a fixed offset from the cell being evaluated
+	struct Tap : Expr<Tap> {
+		const float* p;
+
+		Tap(const float* p) : p(p) {}
+
+		template <typename V>
+		V Eval(int index) const { return Lane<V>::Load(p + index); }
+	};
+
+	struct Field : Expr<Field> {
+		const float* data;
+		int stride;
+
+		Field(const std::vector<float>& f, int n) : data(f.data()), stride(n) {}
+
+		template <typename V>
+		V Eval(int index) const { return Lane<V>::Load(data + index); }
+
+		Tap At(int dx, int dy) const { return Tap(data + dx + dy * stride); }
+	};
+
+	struct Constant : Expr<Constant> {
+		float value;
+
+		explicit Constant(float value) : value(value) {}
+
+		template <typename V>
+		V Eval(int) const { return Lane<V>::Splat(value); }
+	};
+
+	struct Add { template <typename V> static V Apply(V a, V b) { return a + b; } };
+	struct Subtract { template <typename V> static V Apply(V a, V b) { return a - b; } };
+	struct Multiply { template <typename V> static V Apply(V a, V b) { return a * b; } };
+	struct Divide { template <typename V> static V Apply(V a, V b) { return a / b; } };
+
+	template <typename Op, typename L, typename R>
+	struct Binary : Expr<Binary<Op, L, R>> {
+		L l;
+		R r;
+
+		Binary(const L& l, const R& r) : l(l), r(r) {}
+
+		template <typename V>
+		V Eval(int index) const { return Op::Apply(l.template Eval<V>(index), r.template Eval<V>(index)); }
+	};
+
+#define STENCIL_OPERATOR(symbol, Op) \
+	template <typename L, typename R> \
+	Binary<Op, L, R> operator symbol(const Expr<L>& l, const Expr<R>& r) { return Binary<Op, L, R>(l.Self(), r.Self()); } \
+	template <typename L> \
+	Binary<Op, L, Constant> operator symbol(const Expr<L>& l, float r) { return Binary<Op, L, Constant>(l.Self(), Constant(r)); } \
+	template <typename R> \
+	Binary<Op, Constant, R> operator symbol(float l, const Expr<R>& r) { return Binary<Op, Constant, R>(Constant(l), r.Self()); }
+
+	STENCIL_OPERATOR(+, Add)
+	STENCIL_OPERATOR(-, Subtract)
+	STENCIL_OPERATOR(*, Multiply)
+	STENCIL_OPERATOR(/, Divide)
+#undef STENCIL_OPERATOR
+
+	template <typename E>
+	struct Assignment {
+		float* out;
+		int origin;
+		E expr;
+	};
+
+	// The output may hold only part of the grid, starting at cell index origin
+	template <typename E>
+	Assignment<E> Assign(std::vector<float>& out, const Expr<E>& expr, int origin = 0) {
+		return { out.data(), origin, expr.Self() };
+	}
+
+	template <typename V, typename... A>
+	inline void StoreAll(int index, const A&... assignments) {
+		int expand[] = { (Lane<V>::Store(assignments.out + (index - assignments.origin), assignments.expr.template Eval<V>(index)), 0)... };
+		(void)expand;
+	}
+
+	// Every assignment over the flat cells [begin, end), widest registers first and a scalar tail
+	template <typename... A>
+	void Evaluate(int begin, int end, const A&... assignments) {
+		int index = begin;
+#if defined(__AVX2__)
+		for (; index + 8 <= end; index += 8)
+			StoreAll<Vec8>(index, assignments...);
+#endif
+#ifdef STENCIL_SSE2
+		for (; index + 4 <= end; index += 4)
+			StoreAll<Vec4>(index, assignments...);
+#endif
+		for (; index < end; index++)
+			StoreAll<float>(index, assignments...);
+	}
+
+	// Interior cells of row j on an n x n grid
+	template <typename... A>
+	void EvaluateRow(int j, int n, const A&... assignments) {
+		Evaluate(j * n + 1, j * n + n - 1, assignments...);
+	}
+}
+
+#endif
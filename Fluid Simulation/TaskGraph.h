@@ -0,0 +1,69 @@
+#pragma once
+#ifndef TASK_GRAPH_H
+#define TASK_GRAPH_H
+
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Stages with the order they must keep between them. Run starts a stage on the pool as soon as the stages it was
+// ordered after are done, so independent stages overlap, and each still spreads its own ParallelFor loops over
+// whichever threads are free. Stages that touch the same data must be ordered, even if they only share scratch.
+class TaskGraph {
+private:
+	struct Task {
+		std::function<void()> run;
+		std::vector<int> next;
+		int after = 0;
+	};
+
+	std::vector<Task> tasks;
+
+public:
+	int Add(std::function<void()> run);
+	void Order(int first, int then);
+	void Run(ThreadPool& pool);
+};
+
+int TaskGraph::Add(std::function<void()> run) {
+	Task task;
+	task.run = std::move(run);
+	tasks.push_back(std::move(task));
+	return static_cast<int>(tasks.size()) - 1;
+}
+
+void TaskGraph::Order(int first, int then) {
+	tasks[first].next.push_back(then);
+	tasks[then].after++;
+}
+
+void TaskGraph::Run(ThreadPool& pool) {
+	int count = static_cast<int>(tasks.size());
+	std::unique_ptr<std::atomic<int>[]> waiting(new std::atomic<int>[count]);
+	for (int k = 0; k < count; k++)
+		waiting[k].store(tasks[k].after);
+	std::atomic<int> remaining{ count };
+
+	// Ready stages queue first in, first out, so a single thread runs them in the order they became ready
+	std::function<void(int)> start = [this, &pool, &waiting, &remaining, &start](int k) {
+		pool.Submit([this, &waiting, &remaining, &start, k] {
+			tasks[k].run();
+			for (int then : tasks[k].next) {
+				if (waiting[then].fetch_sub(1) == 1)
+					start(then);
+			}
+			remaining.fetch_sub(1);
+		});
+	};
+
+	for (int k = 0; k < count; k++) {
+		if (tasks[k].after == 0)
+			start(k);
+	}
+	pool.Help([&remaining] { return remaining.load() == 0; });
+}
+
+#endif
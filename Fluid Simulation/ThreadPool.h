@@ -0,0 +1,188 @@
+#pragma once
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+private:
+	// A ParallelFor in flight. Any thread that finds it in the list may join and claim chunks, so a loop started
+	// from inside another loop or a task still spreads over whichever threads are idle.
+	struct Loop {
+		const std::function<void(int, int)>* body;
+		int end;
+		int grain;
+		std::atomic<int> next;
+		int running;
+	};
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	std::vector<Loop*> loops;
+	std::deque<std::function<void()>> tasks;
+	bool stopping = false;
+
+private:
+	void WorkerLoop();
+	void StartWorkers(unsigned int threads);
+	void StopWorkers();
+	bool RunPending(std::unique_lock<std::mutex>& lock);
+	static void RunChunks(Loop& loop);
+
+public:
+	ThreadPool(unsigned int threads = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int ThreadCount() const;
+	void SetThreadCount(unsigned int threads);
+	void ParallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body);
+
+	// Queues a task for the first idle thread. Nothing waits on it by itself: Help runs pool work on the calling
+	// thread until finished() holds, which is checked again whenever a task completes.
+	void Submit(std::function<void()> task);
+	void Help(const std::function<bool()>& finished);
+};
+
+ThreadPool::ThreadPool(unsigned int threads) {
+	StartWorkers(threads);
+}
+
+ThreadPool::~ThreadPool() {
+	StopWorkers();
+}
+
+void ThreadPool::StartWorkers(unsigned int threads) {
+	// The calling thread takes a share of every job, so it counts as one of the threads
+	for (unsigned int t = 1; t < threads; t++)
+		workers.emplace_back(&ThreadPool::WorkerLoop, this);
+}
+
+void ThreadPool::StopWorkers() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+	workers.clear();
+	stopping = false;
+}
+
+int ThreadPool::ThreadCount() const {
+	return static_cast<int>(workers.size()) + 1;
+}
+
+void ThreadPool::SetThreadCount(unsigned int threads) {
+	// Only from the owning thread between jobs
+	if (threads < 1) { threads = 1; }
+	if (static_cast<int>(threads) == ThreadCount())
+		return;
+
+	StopWorkers();
+	StartWorkers(threads);
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body) {
+	if (grain < 1) { grain = 1; }
+
+	if (workers.empty() || end - begin <= grain) {
+		if (begin < end)
+			body(begin, end);
+		return;
+	}
+
+	Loop loop;
+	loop.body = &body;
+	loop.end = end;
+	loop.grain = grain;
+	loop.next.store(begin);
+	loop.running = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		loops.push_back(&loop);
+	}
+	wake.notify_all();
+
+	RunChunks(loop);
+
+	// Once the loop is off the list nobody new can join, so it is finished when the threads inside it leave
+	std::unique_lock<std::mutex> lock(mutex);
+	loops.erase(std::remove(loops.begin(), loops.end(), &loop), loops.end());
+	done.wait(lock, [&loop] { return loop.running == 0; });
+}
+
+void ThreadPool::RunChunks(Loop& loop) {
+	for (int start = loop.next.fetch_add(loop.grain); start < loop.end; start = loop.next.fetch_add(loop.grain))
+		(*loop.body)(start, (loop.end - start < loop.grain) ? loop.end : start + loop.grain);
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(task));
+	}
+	// Every sleeper, since a helper that wakes to find its own work finished goes back without taking this one
+	wake.notify_all();
+}
+
+void ThreadPool::Help(const std::function<bool()>& finished) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!finished()) {
+		if (!RunPending(lock))
+			wake.wait(lock);
+	}
+}
+
+bool ThreadPool::RunPending(std::unique_lock<std::mutex>& lock) {
+	// Loops first: their callers are already blocked on them, while a queued task holds nobody up until it starts
+	for (size_t k = 0; k < loops.size(); k++) {
+		Loop* loop = loops[k];
+		if (loop->next.load() >= loop->end)
+			continue;
+
+		loop->running++;
+		lock.unlock();
+		RunChunks(*loop);
+		lock.lock();
+		if (--loop->running == 0)
+			done.notify_all();
+		return true;
+	}
+
+	if (tasks.empty())
+		return false;
+
+	std::function<void()> task = std::move(tasks.front());
+	tasks.pop_front();
+	lock.unlock();
+	task();
+	lock.lock();
+	wake.notify_all();
+	return true;
+}
+
+void ThreadPool::WorkerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		if (!RunPending(lock))
+			wake.wait(lock);
+	}
+}
+
+#endif
@@ -0,0 +1,125 @@
+#pragma once
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Runs a sequence of grid stages tile by tile. Consecutive tile stages form a chain that each tile carries through
+// back to back while its cells are still in cache: a stage runs over the tile grown by the reach of the stages
+// after it, so a tile recomputes the halo it needs instead of waiting on its neighbours. A global stage ends the
+// chain and runs once every tile is done, which makes it the only barrier.
+//
+// Tiles are bands of whole rows, so a tile and its halo are one contiguous stretch of every field, and a scratch
+// buffer of 2 * TileRows() + 2 rows holds any window a chain stage can be given.
+//
+// Tiles of a chain run concurrently, so only its last stage may write shared fields, only the tile's own cells,
+// and only fields the chain does not read; earlier stages write the scratch slot of the thread running them.
+class TileScheduler {
+public:
+	// Half-open window of cells
+	struct Rect {
+		int x0, y0, x1, y1;
+	};
+
+	static const int GLOBAL = -1;
+
+	struct Stage {
+		// How far past a cell the stage reads the previous stage's output (ignored for the first stage of a chain),
+		// or GLOBAL for a stage that needs every cell of it
+		int reach;
+		// Cells to compute and the running thread's scratch slot; a global stage gets the whole grid and slot 0
+		std::function<void(const Rect&, int)> run;
+	};
+
+private:
+	ThreadPool& pool;
+	int tileRows = 32;
+
+private:
+	void RunChain(int n, const Stage* chain, int count);
+
+public:
+	TileScheduler(ThreadPool& pool);
+
+	void SetTileRows(int rows);
+	int TileRows() const;
+	int Slots() const;
+	int MaxHalo() const;
+
+	void Run(int n, const std::vector<Stage>& stages);
+};
+
+TileScheduler::TileScheduler(ThreadPool& pool) : pool(pool) {}
+
+void TileScheduler::SetTileRows(int rows) {
+	tileRows = rows < 4 ? 4 : rows;
+}
+
+int TileScheduler::TileRows() const {
+	return tileRows;
+}
+
+int TileScheduler::Slots() const {
+	return pool.ThreadCount();
+}
+
+int TileScheduler::MaxHalo() const {
+	// Past half a tile the grown windows more than double a tile's work, and a barrier is cheaper
+	return tileRows / 2;
+}
+
+void TileScheduler::Run(int n, const std::vector<Stage>& stages) {
+	int count = static_cast<int>(stages.size());
+	for (int k = 0; k < count;) {
+		if (stages[k].reach == GLOBAL) {
+			stages[k].run({ 0, 0, n, n }, 0);
+			k++;
+			continue;
+		}
+
+		int end = k + 1;
+		while (end < count && stages[end].reach != GLOBAL)
+			end++;
+		RunChain(n, &stages[k], end - k);
+		k = end;
+	}
+}
+
+void TileScheduler::RunChain(int n, const Stage* chain, int count) {
+	// Tiles cover the interior; the grown windows may spill onto the boundary ring
+	int tiles = (n - 2 + tileRows - 1) / tileRows;
+
+	std::vector<int> halo(count);
+	int grow = 0;
+	for (int k = count - 1; k >= 0; k--) {
+		halo[k] = grow;
+		grow += chain[k].reach;
+	}
+
+	// One chunk per slot, each pulling tiles until none are left, so a slot's scratch is only ever used by one thread
+	std::atomic<int> nextTile{ 0 };
+	pool.ParallelFor(0, Slots(), 1, [this, n, chain, count, tiles, &halo, &nextTile](int begin, int end) {
+		for (int slot = begin; slot < end; slot++) {
+			for (int t = nextTile.fetch_add(1); t < tiles; t = nextTile.fetch_add(1)) {
+				int y0 = 1 + t * tileRows;
+				int y1 = (y0 + tileRows < n - 1) ? y0 + tileRows : n - 1;
+
+				for (int k = 0; k < count; k++) {
+					Rect cells = {
+						(halo[k] > 0) ? 0 : 1,
+						(y0 - halo[k] > 0) ? y0 - halo[k] : 0,
+						(halo[k] > 0) ? n : n - 1,
+						(y1 + halo[k] < n) ? y1 + halo[k] : n
+					};
+					chain[k].run(cells, slot);
+				}
+			}
+		}
+	});
+}
+
+#endif
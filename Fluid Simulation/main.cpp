@@ -6,13 +6,20 @@
 #include <fstream>
 #include <iostream>
 
+#include "FixedPointFluid.h"
 #include "Fluid.h"
+#include "LatticeBoltzmann.h"
+#include "ParticleFluid.h"
+#include "StaticFluid.h"
 
-Fluid* fluid;
+Simulation* fluid;
 
 const unsigned int SCR_WIDTH = 1080;
 const unsigned int SCR_HEIGHT = 1080;
 const unsigned int grid_size = 216;
+const float diffusion = 0.00001f;
+const float viscosity = 0.001f;
+const std::string tuning_cache = "fluid_tuning.cache";
 
 void* SSBOptrData;
 
@@ -25,6 +32,7 @@ float deltaTime = 0.0f;
 
 std::string read_shader(const std::string& filename);
 unsigned int compile_shader(unsigned int type, const std::string& shader_path);
+Simulation* create_stable_fluid();
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_position_callback(GLFWwindow* window, double xpos, double ypos);
@@ -95,7 +103,7 @@ int main()
 		return 1;
 	}
 
-	fluid = new Fluid(grid_size, 0.00001f, 0.001f);
+	fluid = create_stable_fluid();
 
 	unsigned int SSBO;
 	glGenBuffers(1, &SSBO);
@@ -195,6 +203,36 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 
 	if (key == GLFW_KEY_S && action == GLFW_PRESS)
 		fluid->SetHSVSpace();
+
+	if (key == GLFW_KEY_1 && action == GLFW_PRESS) {
+		delete fluid;
+		fluid = create_stable_fluid();
+	}
+
+	if (key == GLFW_KEY_2 && action == GLFW_PRESS) {
+		delete fluid;
+		fluid = new LatticeBoltzmann(grid_size, diffusion, viscosity);
+	}
+
+	if (key == GLFW_KEY_3 && action == GLFW_PRESS) {
+		delete fluid;
+		fluid = new ParticleFluid(grid_size, diffusion, viscosity);
+	}
+
+	if (key == GLFW_KEY_4 && action == GLFW_PRESS) {
+		delete fluid;
+		fluid = new FixedPointFluid(grid_size, diffusion, viscosity);
+	}
+
+	if (key == GLFW_KEY_5 && action == GLFW_PRESS) {
+		Simulation* specialized = CreateStaticFluid(grid_size, diffusion, viscosity);
+		if (!specialized) {
+			std::cout << "No compile-time stable fluids engine for a grid size of " << grid_size << "\n";
+			return;
+		}
+		delete fluid;
+		fluid = specialized;
+	}
 }
 
 void process_input(GLFWwindow* window) {
@@ -207,6 +245,15 @@ void process_input(GLFWwindow* window) {
 
 // Utility Functions
 
+Simulation* create_stable_fluid() {
+	// Benchmarks the pressure solver on the first run for this CPU and grid size, then reads the pick from the cache.
+	// Sparse tiles skip the still parts of the grid whenever the picked solvers relax in place.
+	Fluid* stable = new Fluid(grid_size, diffusion, viscosity);
+	stable->AutoTune(tuning_cache);
+	stable->SetSparseTiles(true);
+	return stable;
+}
+
 std::string read_shader(const std::string& filename) {
 	std::ifstream fileReader(filename);
 	if (!fileReader.is_open()) {